@@ -0,0 +1,245 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "simple_http.h"
+#include "uv.h"
+
+using namespace std;
+using namespace simple_http;
+using namespace std::chrono;
+
+// Open-loop load generator: requests are scheduled at a constant rate and
+// their latency is measured from the scheduled time, not from the time they
+// could be sent, so that a stalled server is not hidden by a stalled client
+// (coordinated omission).
+
+struct Options {
+  string host = "127.0.0.1";
+  int port = 8000;
+  int connections = 4;
+  int depth = 1;
+  int rate = 1000;            // Requests per second.
+  int duration_s = 10;
+  int timeout_ms = 10000;
+  string url = "/";
+  string url_file;
+  bool scrape_varz = false;
+};
+
+static Options opt;
+static ClientPool *pool;
+static vector<string> urls;
+static vector<double> weights;
+static std::discrete_distribution<size_t> pick_url;
+static std::mt19937 rng(12345);
+
+static uv_timer_t tick;
+static steady_clock::time_point start;
+static long long total, scheduled, completed, errors, timeouts;
+static vector<long long> latencies_us;     // Corrected for coordinated omission.
+static map<string, long long> varz_before;
+
+static void usage() {
+  fprintf(stderr,
+    "Usage: ./bench_client [options]\n"
+    "  -h host          (default 127.0.0.1)\n"
+    "  -p port          (default 8000)\n"
+    "  -c connections   (default 4)\n"
+    "  -d depth         pipelined requests per connection (default 1)\n"
+    "  -r rate          requests per second (default 1000)\n"
+    "  -t seconds       duration (default 10)\n"
+    "  -T ms            request timeout (default 10000)\n"
+    "  -u url           the URL to request (default /)\n"
+    "  -f file          URL mix, one \"[weight] url\" per line\n"
+    "  -v               print the deltas of the server /varz counters\n"
+    "Example: ./bench_client -c 8 -d 4 -r 20000 -t 30 -u /add/1,2\n");
+  exit(1);
+}
+
+static void load_urls() {
+  if (opt.url_file.empty()) {
+    urls.push_back(opt.url);
+    weights.push_back(1);
+  } else {
+    ifstream in(opt.url_file);
+    if (!in) {
+      fprintf(stderr, "Cannot read %s\n", opt.url_file.c_str());
+      exit(1);
+    }
+    string line;
+    while (getline(in, line)) {
+      istringstream ss(line);
+      string first, second;
+      if (!(ss >> first) || first[0] == '#') continue;
+      if (ss >> second) {
+        weights.push_back(atof(first.c_str()));
+        urls.push_back(second);
+      } else {
+        weights.push_back(1);
+        urls.push_back(first);
+      }
+    }
+    if (urls.empty()) {
+      fprintf(stderr, "No URL in %s\n", opt.url_file.c_str());
+      exit(1);
+    }
+  }
+  pick_url = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+}
+
+// Extracts the top-level numeric values of the /varz JSON.
+static map<string, long long> parse_varz(const string &json) {
+  map<string, long long> values;
+  size_t pos = 0;
+  while ((pos = json.find('"', pos)) != string::npos) {
+    size_t end = json.find('"', pos + 1);
+    if (end == string::npos) break;
+    string key = json.substr(pos + 1, end - pos - 1);
+    pos = end + 1;
+    if (pos < json.size() && json[pos] == ':' && pos + 1 < json.size() &&
+        (isdigit(json[pos + 1]) || json[pos + 1] == '-')) {
+      values[key] = atoll(json.c_str() + pos + 1);
+    }
+  }
+  return values;
+}
+
+static void scrape_varz(function<void(const map<string, long long>&)> done) {
+  static Client *client = new Client(opt.host.c_str(), opt.port);
+  client->request("/varz", "", [done](const string &res) { done(parse_varz(res)); });
+}
+
+static void print_report() {
+  double elapsed = duration_cast<microseconds>(steady_clock::now() - start).count() / 1e6;
+  printf("%lld requests in %.2fs, %lld errors, %lld timeouts, %lld not completed\n",
+    scheduled, elapsed, errors, timeouts, scheduled - completed);
+  printf("Throughput: %.1f requests/s (target %d)\n", completed / elapsed, opt.rate);
+
+  sort(latencies_us.begin(), latencies_us.end());
+  if (latencies_us.empty()) return;
+  printf("Latency (ms), corrected for coordinated omission:\n");
+  printf("  %10s %12s %10s\n", "percentile", "latency", "count");
+  const double percentiles[] = { 0, 50, 75, 90, 95, 99, 99.9, 99.99, 100 };
+  for (double p : percentiles) {
+    size_t i = min(latencies_us.size() - 1, (size_t) (latencies_us.size() * p / 100));
+    printf("  %10.2f %12.3f %10zu\n", p, latencies_us[i] / 1000.0, i + 1);
+  }
+
+  // The full histogram, in power-of-two buckets.
+  printf("Histogram (ms):\n");
+  size_t i = 0;
+  for (long long upper = 1; i < latencies_us.size(); upper *= 2) {
+    size_t j = upper_bound(latencies_us.begin(), latencies_us.end(), upper) - latencies_us.begin();
+    if (j > i) printf("  <= %10.3f %10zu\n", upper / 1000.0, j - i);
+    i = j;
+  }
+}
+
+static void finish() {
+  static bool finished = false;
+  if (finished) return;
+  finished = true;
+  uv_timer_stop(&tick);
+  print_report();
+  if (!opt.scrape_varz) {
+    pool->close();
+    exit(0);
+  }
+  scrape_varz([](const map<string, long long> &after) {
+    printf("Server /varz deltas:\n");
+    for (auto &kv : after) {
+      auto it = varz_before.find(kv.first);
+      long long delta = kv.second - (it == varz_before.end() ? 0 : it->second);
+      if (delta) printf("  %-40s %lld\n", kv.first.c_str(), delta);
+    }
+    exit(0);
+  });
+}
+
+static void send_request(steady_clock::time_point intended) {
+  RequestOptions options;
+  options.deadline_ms = opt.timeout_ms;
+  const string &url = urls[pick_url(rng)];
+  pool->request(url.c_str(), "", options, [intended](RequestError error, const string &body) {
+    completed++;
+    if (error == RequestError::DEADLINE_EXCEEDED) {
+      timeouts++;
+    } else {
+      if (error != RequestError::NONE) errors++;
+      latencies_us.push_back(duration_cast<microseconds>(steady_clock::now() - intended).count());
+    }
+    if (completed == total) finish();
+  });
+}
+
+// Sends the requests scheduled up to now.
+static void on_tick(uv_timer_t *timer) {
+  auto now = steady_clock::now();
+  while (scheduled < total) {
+    auto intended = start + microseconds(scheduled * 1000000 / opt.rate);
+    if (intended > now) break;
+    scheduled++;
+    send_request(intended);
+  }
+  if (scheduled == total && now - start > seconds(opt.duration_s) + milliseconds(opt.timeout_ms) * 2) {
+    finish();   // Give up on the responses that never came.
+  }
+}
+
+static void run() {
+  start = steady_clock::now();
+  latencies_us.reserve(total);
+  uv_timer_init(uv_default_loop(), &tick);
+  uv_timer_start(&tick, on_tick, 0, 1);
+}
+
+int main(int argc, char *argv[]) {
+  int c;
+  while ((c = getopt(argc, argv, "h:p:c:d:r:t:T:u:f:v")) != -1) {
+    switch (c) {
+      case 'h': opt.host = optarg; break;
+      case 'p': opt.port = atoi(optarg); break;
+      case 'c': opt.connections = atoi(optarg); break;
+      case 'd': opt.depth = atoi(optarg); break;
+      case 'r': opt.rate = atoi(optarg); break;
+      case 't': opt.duration_s = atoi(optarg); break;
+      case 'T': opt.timeout_ms = atoi(optarg); break;
+      case 'u': opt.url = optarg; break;
+      case 'f': opt.url_file = optarg; break;
+      case 'v': opt.scrape_varz = true; break;
+      default: usage();
+    }
+  }
+  if (opt.connections < 1 || opt.depth < 1 || opt.rate < 1 || opt.duration_s < 1) usage();
+  load_urls();
+  total = (long long) opt.rate * opt.duration_s;
+  Log::max_level = Log::WARN;
+
+  pool = new ClientPool({ opt.host + ":" + to_string(opt.port) }, opt.connections);
+  pool->set_pipeline_depth(opt.depth);
+
+  // Start once connected, after a warm-up request.
+  pool->request(urls[0].c_str(), "", [](const string &res) {
+    if (opt.scrape_varz) {
+      scrape_varz([](const map<string, long long> &before) {
+        varz_before = before;
+        run();
+      });
+    } else {
+      run();
+    }
+  });
+
+  uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+}
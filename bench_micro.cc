@@ -0,0 +1,200 @@
+// Microbenchmarks of the per-request hot paths. The internals are not part
+// of the public API, so the library source is compiled into this program.
+//
+// Prints one JSON object per line:
+//   {"benchmark":"parse/get_small","iterations":1000000,"ns_per_op":120.5,"allocs_per_op":0.00}
+
+#include "simple_http.cc"
+
+#include <new>
+
+using namespace simple_http;
+
+// Counts the heap allocations of the whole program. The replaced operators
+// form a matching set, new and delete with their array and sized forms. They
+// are not inlined, so that the compiler does not pair malloc() and free()
+// with new and delete expressions (-Wmismatched-new-delete).
+static std::atomic<unsigned long long> num_allocs(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) { return operator new(size); }
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// Runs op in batches until at least min_ms elapsed, then prints the cost of
+// one op. Each call of op performs ops_per_call operations.
+static void run(const char *name, function<void()> op, int ops_per_call = 1, int min_ms = 300) {
+  for (int i = 0; i < 1000; i++) op();   // Warm up the pools and caches.
+  unsigned long long calls = 0, allocs = num_allocs.load();
+  auto start = steady_clock::now();
+  double elapsed_ns;
+  for (unsigned long long batch = 1000; ; batch *= 2) {
+    for (unsigned long long i = 0; i < batch; i++) op();
+    calls += batch;
+    elapsed_ns = duration_cast<std::chrono::nanoseconds>(steady_clock::now() - start).count();
+    if (elapsed_ns >= min_ms * 1e6) break;
+  }
+  double ops = (double) calls * ops_per_call;
+  printf("{\"benchmark\":\"%s\",\"iterations\":%.0f,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n",
+    name, ops, elapsed_ns / ops, (num_allocs.load() - allocs) / ops);
+  fflush(stdout);
+}
+
+
+/***** Parser *****/
+
+// Feeds a canned byte stream through on_read as if it came from a socket.
+// The stream is fake: the parser only uses it to find itself.
+static void bench_parser(const char *name, const string &stream, int num_requests) {
+  HttpParser parser;
+  uv_tcp_t fake;
+  memset(&fake, 0, sizeof(fake));
+  fake.data = &parser;
+  parser.tcp = (uv_stream_t*) &fake;
+  http_parser_init(&parser.parser, HTTP_REQUEST);
+  int completed = 0;
+  parser.msg_cb = [&completed](Request &req) { completed++; };
+  parser.close_cb = []() { assert(0); };
+  assert(stream.size() <= (size_t) MAX_BUFFER_LEN);
+
+  run(name, [&]() {
+    uv_buf_t buf;
+    on_alloc((uv_handle_t*) &fake, MAX_BUFFER_LEN, &buf);
+    memcpy(buf.base, stream.data(), stream.size());
+    on_read((uv_stream_t*) &fake, stream.size(), &buf);
+  }, num_requests);
+  assert(completed > 0);
+}
+
+static void bench_parsers() {
+  string get_small = "GET /add/1,2 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  string get_browser =
+    "GET /static/app.js?v=12 HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/90.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "If-None-Match: \"5f3e2a-1c2b\"\r\n"
+    "Referer: http://localhost:8000/\r\n\r\n";
+  string post_1k = "POST /submit HTTP/1.1\r\nHost: localhost\r\nContent-Length: 1024\r\n\r\n" + string(1024, 'x');
+  string pipelined;
+  for (int i = 0; i < 16; i++) pipelined += get_small;
+
+  bench_parser("parse/get_small", get_small, 1);
+  bench_parser("parse/get_browser", get_browser, 1);
+  bench_parser("parse/post_1k", post_1k, 1);
+  bench_parser("parse/pipelined_16", pipelined, 16);
+}
+
+
+/***** Router *****/
+
+// The routes are registered as Server::get() does, with their histograms.
+static void bench_router(int num_routes) {
+  ServerImpl server;
+  Handler handler = [](Request &req, Response &res) {};
+  vector<string> urls;
+  for (int i = 0; i < num_routes; i++) {
+    char pattern[64], url[64];
+    switch (i % 3) {
+      case 0:
+        snprintf(pattern, sizeof(pattern), "/api/v1/resource%d/:id<int>", i);
+        snprintf(url, sizeof(url), "/api/v1/resource%d/%d", i, i * 7);
+        break;
+      case 1:
+        snprintf(pattern, sizeof(pattern), "/api/v1/items%d/:name/detail$", i);
+        snprintf(url, sizeof(url), "/api/v1/items%d/widget/detail", i);
+        break;
+      default:
+        snprintf(pattern, sizeof(pattern), "/static%d/", i);
+        snprintf(url, sizeof(url), "/static%d/css/site.css?v=3", i);
+    }
+    server.route(Method::GET, pattern, handler);
+    urls.push_back(url);
+  }
+  urls.push_back("/not/found");
+
+  vector<Request> reqs(urls.size());
+  for (size_t i = 0; i < urls.size(); i++) {
+    reqs[i].method = Method::GET;
+    reqs[i].url = urls[i];
+  }
+  size_t next = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "route/match_%d", num_routes);
+  run(name, [&]() {
+    Request &req = reqs[next];
+    next = (next + 7) % reqs.size();
+    req.params.clear();
+    bool other_method = false;
+    server.router.match(req, &other_method);
+  });
+}
+
+
+/***** Serializer *****/
+
+// Builds the response body, then the status line and headers and the
+// buffers of the write, as flush() and Connection::write_responses() do.
+static void bench_serializer(size_t body_size) {
+  ServerImpl server;
+  Worker worker(&server, 0);
+  Connection connection(&worker);
+  string body(body_size, 'b');
+  string prefix = "/bench";
+  Histogram latency = server.varz.histogram(prefix);
+  vector<uv_buf_t> bufs;
+  char name[64];
+  snprintf(name, sizeof(name), "serialize/body_%zu", body_size);
+  run(name, [&]() {
+    ResponseImpl *res = worker.response_pool.create(&connection, &prefix, latency);
+    res->body.write(body.data(), body.size());
+    res->write_response();
+    bufs.clear();
+    res->append_bufs(bufs);
+    worker.response_pool.destroy(res);
+  });
+}
+
+
+/***** Varz *****/
+
+static void bench_varz() {
+  Varz varz;
+  Counter counter = varz.counter("bench_counter");
+  Histogram histogram = varz.histogram("bench_latency");
+  Histogram precise = varz.histogram("bench_latency_precise", 3);
+  int us = 0;
+  run("varz/counter_inc", [&]() { counter.inc(); });
+  // A thread updating several Varz, e.g. of a server and its clients.
+  Varz others[8];
+  vector<Counter> counters;
+  for (auto &v : others) counters.push_back(v.counter("bench_counter"));
+  size_t next = 0;
+  run("varz/counter_inc_8_varz", [&]() { counters[next++ % counters.size()].inc(); });
+  run("varz/inc_by_key", [&]() { varz.inc("bench_key"); });
+  run("varz/histogram_add", [&]() { histogram.add(us = (us * 1103515245 + 12345) & 0xfffff); });
+  run("varz/histogram_add_3_digits", [&]() { precise.add(us = (us * 1103515245 + 12345) & 0xfffff); });
+  run("varz/latency_by_key", [&]() { varz.latency("bench_latency", us = (us * 1103515245 + 12345) & 0xfffff); });
+}
+
+
+int main(int argc, char *argv[]) {
+  Log::max_level = Log::WARN;
+  bench_parsers();
+  for (int n : { 10, 100, 1000 }) bench_router(n);
+  for (size_t size : { 0, 100, 10000, 1000000 }) bench_serializer(size);
+  bench_varz();
+}
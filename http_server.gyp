@@ -1,4 +1,7 @@
 {
+  'variables': {
+    'io_uring%': 0,     # GYP_DEFINES=io_uring=1 builds the io_uring engine (Linux 5.19+).
+  },
   'targets': [
     {
       'target_name': 'http_server',
@@ -10,8 +13,14 @@
         'libuv/uv.gyp:libuv',
         'http-parser/http_parser.gyp:http_parser'
       ],
+      'link_settings': {
+        'libraries': [ '-lz' ],
+      },
       'cflags_cc': [ '-std=c++11' ],
       'conditions': [
+         ['OS == "linux" and io_uring == 1', {
+            'defines': [ 'SIMPLE_HTTP_IO_URING' ],
+         }],
          ['OS == "mac"', {
             'xcode_settings': {
               'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
@@ -54,6 +63,84 @@
         'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
         'OTHER_CPLUSPLUSFLAGS': [ '-stdlib=libc++' ]
       },
+    },
+
+    {
+      'target_name': 'test_http',
+      'type': 'executable',
+      'sources': [
+        'test_http.cc',
+      ],
+      'include_dirs': [],
+      'dependencies': [
+        'http_server.gyp:http_server',
+      ],
+      'cflags_cc': [ '-std=c++11' ],
+      'xcode_settings': {
+        'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
+        'OTHER_CPLUSPLUSFLAGS': [ '-stdlib=libc++' ]
+      },
+    },
+
+    {
+      # The same tests, plus the coroutine handlers of simple_http_coro.h.
+      'target_name': 'test_http_coro',
+      'type': 'executable',
+      'sources': [
+        'test_http.cc',
+      ],
+      'include_dirs': [],
+      'dependencies': [
+        'http_server.gyp:http_server',
+      ],
+      'cflags_cc': [ '-std=c++20' ],
+      'xcode_settings': {
+        'CLANG_CXX_LANGUAGE_STANDARD': 'c++20',
+        'OTHER_CPLUSPLUSFLAGS': [ '-stdlib=libc++' ]
+      },
+    },
+
+    {
+      'target_name': 'bench_micro',
+      'type': 'executable',
+      'sources': [
+        # Includes simple_http.cc to reach the internals, which are not part
+        # of the library's interface. So the library is compiled a second
+        # time, into this program, with the flags of this target instead of
+        # linking http_server.
+        'bench_micro.cc',
+      ],
+      'include_dirs': [],
+      'dependencies': [
+        'libuv/uv.gyp:libuv',
+        'http-parser/http_parser.gyp:http_parser'
+      ],
+      'link_settings': {
+        'libraries': [ '-lz' ],
+      },
+      'cflags_cc': [ '-std=c++11' ],
+      'xcode_settings': {
+        'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
+        'OTHER_CPLUSPLUSFLAGS': [ '-stdlib=libc++' ]
+      },
+    },
+
+    {
+      'target_name': 'bench_client',
+      'type': 'executable',
+      'sources': [
+        'bench_client.cc',
+      ],
+      'include_dirs': [],
+      'dependencies': [
+        'libuv/uv.gyp:libuv',
+        'http_server.gyp:http_server',
+      ],
+      'cflags_cc': [ '-std=c++11' ],
+      'xcode_settings': {
+        'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
+        'OTHER_CPLUSPLUSFLAGS': [ '-stdlib=libc++' ]
+      },
     }
   ],
 }
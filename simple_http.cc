@@ -1,95 +1,1052 @@
 #include "http_parser.h"
 #include "simple_http.h"
 #include "uv.h"
+#include "zlib.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef SIMPLE_HTTP_IO_URING
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
 #include <iomanip>
-#include <queue>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace simple_http {
 
 using std::chrono::duration_cast;
 using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::chrono::high_resolution_clock;
 using std::chrono::time_point;
+using std::deque;
 using std::function;
 using std::max;
 using std::min;
+using std::mutex;
+using std::lock_guard;
+using std::make_pair;
 using std::pair;
-using std::queue;
+using std::shared_ptr;
 using std::vector;
 
-// Utility to produce a histogram of request latencies.
-class LatencyHistogram {
-  int buckets[31];
+/***** Varz *****/
 
+// The layout of an HDR (high dynamic range) histogram of values in [0, INT_MAX]:
+// power-of-two buckets, each split linearly into sub-buckets so that every
+// value is recorded with the configured number of significant digits.
+class HdrLayout {
  public:
-  LatencyHistogram() {
-    for (int i = 0; i < 31; i++) buckets[i] = 0;
+  // Returns the shared layout for 1 to 3 significant digits.
+  static const HdrLayout& get(int significant_digits) {
+    static const HdrLayout layouts[] = { HdrLayout(1), HdrLayout(2), HdrLayout(3) };
+    return layouts[min(max(significant_digits, 1), 3) - 1];
   }
-  ~LatencyHistogram() {}
 
-  void add(int us) {
-    if (us < 0) Log::severe("Adding negative runtime: %d us", us);
-    else buckets[31 - __builtin_clz(max(us, 1))]++;
+  int index_of(long long value) const {
+    int bucket = 64 - __builtin_clzll(value | sub_bucket_mask) - (half_magnitude + 1);
+    int sub_bucket = value >> bucket;
+    return ((bucket + 1) << half_magnitude) + (sub_bucket - half_count);
   }
-  void print(ostringstream &ss) {
-    ss << "[";
-    for (int i = 0; i < 30; i++) ss << buckets[i] << ",";
-    ss << buckets[30] << "]";
+
+  // The smallest and largest values recorded at the index.
+  long long lowest_value(int index) const {
+    int bucket, sub_bucket;
+    locate(index, bucket, sub_bucket);
+    return (long long) sub_bucket << bucket;
+  }
+  long long highest_value(int index) const {
+    int bucket, sub_bucket;
+    locate(index, bucket, sub_bucket);
+    return ((long long) sub_bucket << bucket) + (1LL << bucket) - 1;
+  }
+
+  int counts_len;         // Number of counters of a histogram.
+
+ private:
+  explicit HdrLayout(int digits) {
+    long long largest_single_unit = 2;
+    for (int i = 0; i < digits; i++) largest_single_unit *= 10;
+    int magnitude = 0;
+    while ((1LL << magnitude) < largest_single_unit) magnitude++;
+    half_magnitude = magnitude - 1;
+    half_count = 1 << half_magnitude;
+    sub_bucket_mask = (1LL << magnitude) - 1;
+    int buckets = 1;
+    for (long long untrackable = 1LL << magnitude; untrackable <= INT_MAX; untrackable <<= 1) buckets++;
+    counts_len = (buckets + 1) * half_count;
+  }
+
+  void locate(int index, int &bucket, int &sub_bucket) const {
+    bucket = (index >> half_magnitude) - 1;
+    sub_bucket = (index & (half_count - 1)) + half_count;
+    if (bucket < 0) {
+      sub_bucket -= half_count;
+      bucket = 0;
+    }
   }
+
+  int half_magnitude;
+  int half_count;
+  long long sub_bucket_mask;
 };
 
-class VarzImpl {
+// Besides counting since the process start, histograms count in rolling
+// windows. Each window has two sets of counters used in alternate periods and
+// tagged with their period, so rotating is just clearing the older set when
+// a new period starts. The printed window is the last complete period.
+constexpr int NUM_WINDOWS = 3;
+static const int WINDOW_SECONDS[NUM_WINDOWS] = { 10, 60, 600 };
+static const char* const WINDOW_NAMES[NUM_WINDOWS] = { "10s", "1m", "10m" };
+
+// Number of slots of a histogram: the counters since start, then the
+// counters of each window, each preceded by the periods of its two sets.
+static unsigned histogram_slots(const HdrLayout &layout) {
+  return layout.counts_len + NUM_WINDOWS * (2 + 2 * layout.counts_len);
+}
+
+// The statistics written by one thread. Only the owning thread writes, so an
+// update is a relaxed load and store: no lock and no atomic read-modify-write.
+// The slots are allocated in chunks that never move, so other threads can
+// read and merge the shards at any time. The chunks are found through
+// blocks of chunk pointers, also allocated on first use, which together
+// cover every slot number.
+class VarzShard {
  public:
+  static constexpr unsigned CHUNK = 1024;
+  static constexpr unsigned BLOCK = 1024;      // Chunks per block.
+  static constexpr unsigned NUM_BLOCKS = (1ULL << 32) / CHUNK / BLOCK;
+
+  typedef std::atomic<unsigned long long> Slot;
+  typedef std::atomic<Slot*> Block[BLOCK];
+
+  VarzShard() {
+    for (auto &b : blocks) b.store(nullptr, std::memory_order_relaxed);
+  }
+  ~VarzShard() {
+    for (auto &b : blocks) {
+      Block *block = b.load();
+      if (!block) continue;
+      for (auto &c : *block) delete[] c.load();
+      delete[] block;
+    }
+  }
+
+  void add(unsigned slot, unsigned long long value) {
+    auto &v = at(slot);
+    v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+  void set(unsigned slot, unsigned long long value) {
+    at(slot).store(value, std::memory_order_relaxed);
+  }
+  unsigned long long get(unsigned slot) const {
+    Slot *c = chunk(slot, std::memory_order_acquire);
+    return c ? c[slot % CHUNK].load(std::memory_order_relaxed) : 0;
+  }
+
+  // Sets n slots to zero, without allocating the chunks that were never used.
+  void clear(unsigned slot, unsigned n) {
+    for (unsigned i = slot; i < slot + n; i++) {
+      Slot *c = chunk(i, std::memory_order_relaxed);
+      if (c) c[i % CHUNK].store(0, std::memory_order_relaxed);
+      else i |= CHUNK - 1;
+    }
+  }
+
+ private:
+  Slot* chunk(unsigned slot, std::memory_order order) const {
+    Block *block = blocks[slot / CHUNK / BLOCK].load(order);
+    return block ? (*block)[slot / CHUNK % BLOCK].load(order) : nullptr;
+  }
+
+  Slot& at(unsigned slot) {
+    auto &b = blocks[slot / CHUNK / BLOCK];
+    Block *block = b.load(std::memory_order_relaxed);
+    if (!block) {
+      block = new Block[1];
+      for (auto &c : *block) c.store(nullptr, std::memory_order_relaxed);
+      b.store(block, std::memory_order_release);
+    }
+    auto &chunk = (*block)[slot / CHUNK % BLOCK];
+    Slot *c = chunk.load(std::memory_order_relaxed);
+    if (!c) {
+      c = new Slot[CHUNK];
+      for (unsigned i = 0; i < CHUNK; i++) c[i].store(0, std::memory_order_relaxed);
+      chunk.store(c, std::memory_order_release);
+    }
+    return c[slot % CHUNK];
+  }
 
-  VarzImpl() {}
+  std::atomic<Block*> blocks[NUM_BLOCKS];
+};
+
+// The registry of keys of a Varz and the shards of the threads writing to it.
+// Keys are registered once into slots; counters and histograms are then
+// updated through handles, in the shard of the calling thread. The shards are
+// only merged when the statistics are read.
+class VarzImpl {
+ public:
+  VarzImpl(): id(next_id++), num_slots(0) {}
   ~VarzImpl() {}
 
-  unsigned long long get(string key) { return varz[key]; }
-  void set(string key, unsigned long long value) { varz[key] = value; }
-  void inc(string key, unsigned long long value) { varz[key] += value; }
+  // Returns the first slot of the key, registering it if needed.
+  // The layout is null for counters.
+  unsigned slot_of(const string &key, const HdrLayout *layout) {
+    lock_guard<mutex> lock(mu);
+    auto it = keys.find(key);
+    if (it != keys.end()) {
+      if (!it->second.layout != !layout) {
+        Log::severe("Varz key '%s' is used both as a counter and a histogram", key.c_str());
+        abort();
+      }
+      return it->second.slot;
+    }
+    unsigned slot = num_slots;
+    num_slots += layout ? histogram_slots(*layout) : 1;
+    keys[key] = Entry { layout, slot };
+    return slot;
+  }
+
+  // Returns the layout the key was registered with.
+  const HdrLayout* layout_of(const string &key) {
+    lock_guard<mutex> lock(mu);
+    return keys[key].layout;
+  }
+
+  // Returns the shard of the calling thread.
+  VarzShard& shard() {
+    if (id < shard_cache.size && shard_cache.shards[id]) return *shard_cache.shards[id];
+    VarzShard *s;
+    {
+      lock_guard<mutex> lock(mu);
+      VarzShard* &p = thread_shards[std::this_thread::get_id()];
+      if (!p) {
+        shards.push_back(unique_ptr<VarzShard>(new VarzShard()));
+        p = shards.back().get();
+      }
+      s = p;
+    }
+    shard_cache.set(id, s);
+    return *s;
+  }
+
+  unsigned long long get(string key) {
+    unsigned slot = slot_of(key, nullptr);
+    lock_guard<mutex> lock(mu);
+    return merged(slot);
+  }
+  void set(string key, unsigned long long value) { shard().set(slot_of(key, nullptr), value); }
+  void inc(string key, unsigned long long value) { shard().add(slot_of(key, nullptr), value); }
   void latency(string key, int us) {
-    if (!varz_hist.count(key)) {
-      varz_hist[key] = unique_ptr<LatencyHistogram>(new LatencyHistogram());
+    const HdrLayout *layout = &HdrLayout::get(2);
+    unsigned slot = slot_of(key, layout);
+    add_latency(slot, *layout_of(key), us);
+  }
+
+  void add_latency(unsigned slot, const HdrLayout &layout, int us) {
+    if (us < 0) {
+      Log::severe("Adding negative runtime: %d us", us);
+      return;
+    }
+    VarzShard &s = shard();
+    int index = layout.index_of(us);
+    s.add(slot + index, 1);
+    unsigned long long now = time(NULL);
+    unsigned window = slot + layout.counts_len;
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+      unsigned long long period = now / WINDOW_SECONDS[w] + 1;   // 0 is never used.
+      unsigned counts = window + 2 + (period & 1) * layout.counts_len;
+      if (s.get(window + (period & 1)) != period) {
+        s.clear(counts, layout.counts_len);
+        s.set(window + (period & 1), period);
+      }
+      s.add(counts + index, 1);
+      window += 2 + 2 * layout.counts_len;
+    }
+  }
+
+  // Adds all counters and histograms of this varz into total.
+  // Only the counts since start of the histograms are added, not the windows.
+  void add_to(VarzImpl &total) {
+    lock_guard<mutex> lock(mu);
+    VarzShard &dst = total.shard();
+    for (auto &it : keys) {
+      unsigned dst_slot = total.slot_of(it.first, it.second.layout);
+      int n = it.second.layout ? it.second.layout->counts_len : 1;
+      for (int i = 0; i < n; i++) dst.add(dst_slot + i, merged(it.second.slot + i));
     }
-    varz_hist[key]->add(us);
   }
-  void print_to(ostringstream &ss) {
+
+  void print_to(ostream &ss) {
+    lock_guard<mutex> lock(mu);
     ss << "{\n";
     bool first = true;
-    for (auto &it : varz) {
+    for (auto &it : keys) {
+      if (it.second.layout) continue;
       if (first) first = false; else ss << ",\n";
-      ss << "\"" << it.first << "\":" << it.second;
+      ss << "\"" << it.first << "\":" << merged(it.second.slot);
     }
-    for (auto &it : varz_hist) {
+    unsigned long long now = time(NULL);
+    vector<unsigned long long> counts;
+    for (auto &it : keys) {
+      if (!it.second.layout) continue;
+      const HdrLayout &layout = *it.second.layout;
       if (first) first = false; else ss << ",\n";
-      ss << "\"" << it.first << "\":";
-      it.second->print(ss);
+
+      // The power-of-two buckets since start, as before HDR histograms.
+      merged_counts(it.second, -1, now, counts);
+      unsigned long long buckets[31] = {};
+      for (int i = 0; i < layout.counts_len; i++) {
+        buckets[63 - __builtin_clzll(max(layout.lowest_value(i), 1LL))] += counts[i];
+      }
+      ss << "\"" << it.first << "\":[";
+      for (int i = 0; i < 31; i++) ss << (i ? "," : "") << buckets[i];
+      ss << "],\n";
+
+      ss << "\"" << it.first << ":percentiles\":{\"all\":";
+      print_percentiles(ss, layout, counts);
+      for (int w = 0; w < NUM_WINDOWS; w++) {
+        merged_counts(it.second, w, now, counts);
+        ss << ",\"" << WINDOW_NAMES[w] << "\":";
+        print_percentiles(ss, layout, counts);
+      }
+      ss << "}";
     }
     ss << "\n}\n";
   }
 
  private:
-  map<string, unique_ptr<LatencyHistogram>> varz_hist;
-  map<string, unsigned long long> varz;
+  struct Entry {
+    const HdrLayout *layout;    // Null for counters.
+    unsigned slot;
+  };
+
+  // Sum over all shards, mu must be held.
+  unsigned long long merged(unsigned slot) {
+    unsigned long long sum = 0;
+    for (auto &s : shards) sum += s->get(slot);
+    return sum;
+  }
+
+  // Sums the histogram counters of all shards, since start if window < 0,
+  // otherwise of the last complete period of the window. mu must be held.
+  void merged_counts(const Entry &e, int window, unsigned long long now, vector<unsigned long long> &counts) {
+    int len = e.layout->counts_len;
+    counts.assign(len, 0);
+    unsigned first = e.slot;
+    unsigned long long period = 0;
+    if (window >= 0) {
+      period = now / WINDOW_SECONDS[window];   // The previous period, see add_latency.
+      unsigned base = e.slot + len + window * (2 + 2 * len);
+      first = base + 2 + (period & 1) * len;
+      for (auto &s : shards) {
+        if (s->get(base + (period & 1)) != period) continue;
+        for (int i = 0; i < len; i++) counts[i] += s->get(first + i);
+      }
+      return;
+    }
+    for (auto &s : shards) {
+      for (int i = 0; i < len; i++) counts[i] += s->get(first + i);
+    }
+  }
+
+  static void print_percentiles(ostream &ss, const HdrLayout &layout, const vector<unsigned long long> &counts) {
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    static const char* const names[] = { "p50", "p90", "p99", "p99.9" };
+    unsigned long long total = 0;
+    int last = -1;
+    for (int i = 0; i < layout.counts_len; i++) {
+      total += counts[i];
+      if (counts[i]) last = i;
+    }
+    ss << "{\"count\":" << total;
+    for (int p = 0; p < 4; p++) {
+      unsigned long long target = max(1ULL, (unsigned long long) ceil(percentiles[p] / 100 * total));
+      unsigned long long seen = 0;
+      long long value = 0;
+      for (int i = 0; total && i < layout.counts_len; i++) {
+        seen += counts[i];
+        if (seen >= target) {
+          value = layout.highest_value(i);
+          break;
+        }
+      }
+      ss << ",\"" << names[p] << "\":" << value;
+    }
+    ss << ",\"max\":" << (last < 0 ? 0 : layout.highest_value(last)) << "}";
+  }
+
+  // The shards of a thread, indexed by the id of their Varz. The entries of
+  // destroyed Varz are never read again since ids are not reused. Emptied
+  // when the thread exits, an update after that (from a static destructor)
+  // looks its shard up again.
+  struct ShardCache {
+    ~ShardCache() {
+      delete[] shards;
+      shards = nullptr;
+      size = 0;
+    }
+    void set(size_t id, VarzShard *shard) {
+      if (id >= size) {
+        size_t n = max(id + 1, size * 2);
+        VarzShard **grown = new VarzShard*[n]();
+        std::copy(shards, shards + size, grown);
+        delete[] shards;
+        shards = grown;
+        size = n;
+      }
+      shards[id] = shard;
+    }
+
+    VarzShard **shards;
+    size_t size;
+  };
+
+  static std::atomic<size_t> next_id;
+  static thread_local ShardCache shard_cache;
+
+  const size_t id;    // Unique, unlike addresses, for shard_cache.
+  mutex mu;
+  map<string, Entry> keys;
+  unsigned num_slots;
+  vector<unique_ptr<VarzShard>> shards;
+  map<std::thread::id, VarzShard*> thread_shards;
+};
+
+std::atomic<size_t> VarzImpl::next_id(0);
+thread_local VarzImpl::ShardCache VarzImpl::shard_cache;
+
+
+/***** Object Pool *****/
+
+// A freelist of storage for objects of type T that are created and destroyed
+// at a high rate on one loop. Not thread-safe: each loop has its own pools.
+template <typename T>
+class Pool {
+ public:
+  Pool(): capacity(1024), live(0), peak(0), hits(0), misses(0), trimmed(0) {}
+  ~Pool() {
+    for (void *p : free_list) ::operator delete(p);
+  }
+
+  template <typename... Args>
+  T* create(Args&&... args) {
+    void *p;
+    if (free_list.empty()) {
+      p = ::operator new(sizeof(T));
+      misses++;
+    } else {
+      p = free_list.back();
+      free_list.pop_back();
+      hits++;
+    }
+    peak = max(peak, ++live);
+    return new (p) T(std::forward<Args>(args)...);
+  }
+
+  void destroy(T *t) {
+    t->~T();
+    live--;
+    if (free_list.size() < capacity) {
+      free_list.push_back(t);
+    } else {
+      ::operator delete(t);
+    }
+  }
+
+  // Frees the storage that was not needed since the previous trim, i.e.,
+  // keeps only enough to reach the high-water mark of live objects again.
+  void trim() {
+    size_t keep = peak - live;
+    while (free_list.size() > keep) {
+      ::operator delete(free_list.back());
+      free_list.pop_back();
+      trimmed++;
+    }
+    peak = live;
+  }
+
+  // Exports occupancy and hit rate as "<prefix>_live", "<prefix>_free", etc.
+  void export_to(Varz &varz, const string &prefix) {
+    varz.set(prefix + "_live", live);
+    varz.set(prefix + "_free", free_list.size());
+    varz.set(prefix + "_hits", hits);
+    varz.set(prefix + "_misses", misses);
+    varz.set(prefix + "_trimmed", trimmed);
+  }
+
+  size_t capacity;          // Maximum number of free objects kept.
+
+ private:
+  vector<void*> free_list;
+  size_t live;              // Number of objects created and not yet destroyed.
+  size_t peak;              // High-water mark of live since the previous trim.
+  unsigned long long hits, misses, trimmed;
+};
+
+
+/***** Router *****/
+
+constexpr int NUM_METHODS = static_cast<int>(Method::OTHER) + 1;
+
+enum class CaptureType {
+  NONE,
+  STRING,
+  INT,
+};
+
+// A registered handler and the captures of its pattern.
+struct Route {
+  string pattern;                 // As registered, e.g. "/add/:a<int>,:b<int>".
+  vector<string> names;           // Capture names in pattern order.
+  vector<CaptureType> types;      // Capture types in pattern order.
+  Handler handler;
+  StreamHandler stream_handler;   // Instead of handler for streamed bodies.
+  bool offload = false;           // The handler runs on the HandlerPool.
+  Histogram latency;              // Response latencies, keyed by the pattern.
+};
+
+// A node of the radix tree of route patterns. A node either consumes a
+// literal label (compressed path) or a capture.
+struct RouteNode {
+  RouteNode(): capture(CaptureType::NONE) {
+    for (int i = 0; i < NUM_METHODS; i++) prefix_routes[i] = exact_routes[i] = nullptr;
+  }
+
+  string label;                               // Literal text consumed by this node.
+  CaptureType capture;                        // Or the capture consumed by this node.
+  vector<unique_ptr<RouteNode>> children;     // Literal children, with distinct first chars.
+  vector<unique_ptr<RouteNode>> captures;     // Capture children, one per type.
+  Route* prefix_routes[NUM_METHODS];          // Routes matching URLs that continue here.
+  Route* exact_routes[NUM_METHODS];           // Routes matching URLs that end here.
+};
+
+// The result of a route lookup.
+struct RouteMatch {
+  Route *route = nullptr;
+  size_t end = 0;                             // Length of the matched URL prefix.
+  vector<pair<size_t, size_t>> spans;         // URL [begin, end) of each capture.
+};
+
+// Matches URLs against the registered patterns in time proportional to the URL
+// length (plus backtracking over string captures within a path segment).
+class Router {
+ public:
+  Route* add(Method method, const string &pattern, Handler handler);
+
+  // Returns the route with the longest match for the request and fills
+  // req.params. HEAD requests also match GET routes. Returns nullptr if there
+  // is no match; other_method is then set if the URL matches a route of
+  // another method.
+  Route* match(Request &req, bool *other_method);
+
+ private:
+  RouteNode* add_literal(RouteNode *n, const string &s);
+  RouteNode* add_capture(RouteNode *n, CaptureType type);
+  void search(RouteNode *n, int m, const string &url, size_t pos,
+    vector<pair<size_t, size_t>> &spans, RouteMatch &best, bool *other_method);
+
+  RouteNode root;
+  vector<unique_ptr<Route>> routes;
+};
+
+static size_t common_prefix(const string &a, size_t a_pos, const string &b) {
+  size_t i = 0;
+  while (a_pos + i < a.size() && i < b.size() && a[a_pos + i] == b[i]) i++;
+  return i;
+}
+
+RouteNode* Router::add_literal(RouteNode *n, const string &s) {
+  size_t pos = 0;
+  while (pos < s.size()) {
+    RouteNode *next = nullptr;
+    for (auto &c : n->children) {
+      if (c->label[0] == s[pos]) { next = c.get(); break; }
+    }
+    if (!next) {
+      n->children.push_back(unique_ptr<RouteNode>(new RouteNode()));
+      n->children.back()->label = s.substr(pos);
+      return n->children.back().get();
+    }
+    size_t k = common_prefix(s, pos, next->label);
+    if (k < next->label.size()) {
+      // Split the child so that the common prefix gets its own node.
+      unique_ptr<RouteNode> split(new RouteNode());
+      split->label = next->label.substr(0, k);
+      next->label = next->label.substr(k);
+      for (auto &c : n->children) {
+        if (c.get() == next) {
+          split->children.push_back(std::move(c));
+          c = std::move(split);
+          next = c.get();
+          break;
+        }
+      }
+    }
+    n = next;
+    pos += k;
+  }
+  return n;
+}
+
+RouteNode* Router::add_capture(RouteNode *n, CaptureType type) {
+  for (auto &c : n->captures) {
+    if (c->capture == type) return c.get();
+  }
+  n->captures.push_back(unique_ptr<RouteNode>(new RouteNode()));
+  n->captures.back()->capture = type;
+  return n->captures.back().get();
+}
+
+static bool is_name_char(char c) {
+  return isalnum(c) || c == '_';
+}
+
+Route* Router::add(Method method, const string &pattern, Handler handler) {
+  Route *r = new Route();
+  routes.push_back(unique_ptr<Route>(r));
+  r->pattern = pattern;
+  r->handler = handler;
+
+  size_t len = pattern.size();
+  bool exact = len && pattern[len - 1] == '$';
+  if (exact) len--;
+
+  RouteNode *n = &root;
+  size_t i = 0;
+  while (i < len) {
+    if (pattern[i] != ':') {
+      size_t j = pattern.find(':', i);
+      if (j == string::npos || j > len) j = len;
+      n = add_literal(n, pattern.substr(i, j - i));
+      i = j;
+      continue;
+    }
+    size_t j = i + 1;
+    while (j < len && is_name_char(pattern[j])) j++;
+    if (j == i + 1) {
+      Log::severe("Missing capture name at %d in pattern '%s'", (int) i, pattern.c_str());
+      abort();
+    }
+    r->names.push_back(pattern.substr(i + 1, j - i - 1));
+    CaptureType type = CaptureType::STRING;
+    if (pattern.compare(j, 5, "<int>") == 0) {
+      type = CaptureType::INT;
+      j += 5;
+    } else if (pattern.compare(j, 8, "<string>") == 0) {
+      j += 8;
+    }
+    r->types.push_back(type);
+    n = add_capture(n, type);
+    i = j;
+  }
+
+  Route* &slot = (exact ? n->exact_routes : n->prefix_routes)[static_cast<int>(method)];
+  if (slot) {
+    Log::severe("Pattern '%s' conflicts with pattern '%s'", pattern.c_str(), slot->pattern.c_str());
+    abort();
+  }
+  slot = r;
+  return r;
+}
+
+static Route* route_of(RouteNode *n, int m, bool at_end) {
+  return (at_end && n->exact_routes[m]) ? n->exact_routes[m] : n->prefix_routes[m];
+}
+
+static bool has_any_route(RouteNode *n, bool at_end) {
+  for (int i = 0; i < NUM_METHODS; i++) {
+    if (n->prefix_routes[i] || (at_end && n->exact_routes[i])) return true;
+  }
+  return false;
+}
+
+void Router::search(RouteNode *n, int m, const string &url, size_t pos,
+    vector<pair<size_t, size_t>> &spans, RouteMatch &best, bool *other_method) {
+  bool at_end = pos == url.size() || url[pos] == '?';
+  Route *r = route_of(n, m, at_end);
+  if (!r && m == static_cast<int>(Method::HEAD)) r = route_of(n, static_cast<int>(Method::GET), at_end);
+  if (r && (!best.route || pos > best.end)) {
+    best.route = r;
+    best.end = pos;
+    best.spans = spans;
+  } else if (!r && has_any_route(n, at_end)) {
+    *other_method = true;
+  }
+
+  for (auto &c : n->children) {
+    if (pos < url.size() && url[pos] == c->label[0] &&
+        url.compare(pos, c->label.size(), c->label) == 0) {
+      search(c.get(), m, url, pos + c->label.size(), spans, best, other_method);
+      break;
+    }
+  }
+
+  for (auto &c : n->captures) {
+    if (c->capture == CaptureType::INT) {
+      size_t end = pos;
+      if (end < url.size() && url[end] == '-') end++;
+      size_t digits = end;
+      while (end < url.size() && isdigit(url[end])) end++;
+      if (end == digits) continue;
+      spans.push_back(make_pair(pos, end));
+      search(c.get(), m, url, end, spans, best, other_method);
+      spans.pop_back();
+    } else {
+      size_t seg_end = pos;
+      while (seg_end < url.size() && url[seg_end] != '/' && url[seg_end] != '?') seg_end++;
+      // Backtrack from the longest capture within the path segment.
+      for (size_t end = seg_end; end > pos; end--) {
+        spans.push_back(make_pair(pos, end));
+        search(c.get(), m, url, end, spans, best, other_method);
+        spans.pop_back();
+      }
+    }
+  }
+}
+
+Route* Router::match(Request &req, bool *other_method) {
+  *other_method = false;
+  RouteMatch best;
+  vector<pair<size_t, size_t>> spans;
+  search(&root, static_cast<int>(req.method), req.url, 0, spans, best, other_method);
+  if (!best.route) return nullptr;
+  req.params.resize(best.spans.size());
+  for (size_t i = 0; i < best.spans.size(); i++) {
+    Request::Param &p = req.params[i];
+    p.name = &best.route->names[i];
+    p.value = req.url.substr(best.spans[i].first, best.spans[i].second - best.spans[i].first);
+    p.number = best.route->types[i] == CaptureType::INT ? strtoll(p.value.c_str(), nullptr, 10) : 0;
+  }
+  return best.route;
+}
+
+
+class ServerImpl;
+
+// Formats HTTP dates, remembering the last formatted time so that
+// repeated calls within the same second do not call strftime.
+class HttpDate {
+ public:
+  HttpDate(): t(-1), len(0) {}
+
+  // Appends the formatted time to s.
+  void append_to(string &s, time_t now) {
+    if (now != t) {
+      struct tm tm;
+      gmtime_r(&now, &tm);
+      len = strftime(str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+      t = now;
+    }
+    s.append(str, len);
+  }
+
+ private:
+  time_t t;
+  size_t len;
+  char str[40];
+};
+
+class Connection;
+class ResponseImpl;
+class IoRing;
+
+// One event loop of the server with its own listening socket, connections and
+// statistics. Worker 0 runs uv_default_loop() on the thread that called listen().
+class Worker {
+ public:
+  Worker(ServerImpl *s, int id);
+  ~Worker();
+
+  void bind(const struct sockaddr_in &addr, int num_workers, Worker *first);
+  void run();
+
+  // Listens with the io_uring engine, returns false if it is not available.
+  bool listen_uring();
+
+  // Response header buffers are recycled to keep their capacity.
+  void take_header_buffer(string &buf);
+  void recycle_header_buffer(string &buf);
+
+  // Called every second to export the pool statistics and periodically trim the pools.
+  void maintain();
+
+  // Sends the response on this worker's loop, from any other thread. The
+  // responses posted until the loop wakes up are sent in one batch.
+  void post_send(ResponseImpl *res, Response::Code code);
+  void send_posted();
+
+  ServerImpl *server;       // Not owned.
+  int id;
+  int cpu;                  // The CPU this worker is pinned to, or -1.
+  uv_loop_t *loop;          // Either uv_default_loop() or &own_loop.
+  uv_loop_t own_loop;
+  uv_tcp_t listener;
+  uv_thread_t thread;
+  vector<string> header_buffers;
+  size_t header_buffers_capacity;
+  Pool<Connection> connection_pool;
+  Pool<ResponseImpl> response_pool;
+  uv_timer_t maintenance_timer;
+  int maintenance_ticks;
+  HttpDate date;            // For the Date header.
+  HttpDate last_modified;   // For the Last-Modified header.
+  vector<uv_buf_t> write_bufs;  // Of the batch being written, reused.
+#ifdef SIMPLE_HTTP_IO_URING
+  unique_ptr<IoRing> ring;  // With the io_uring engine.
+#endif
+  uv_async_t posted_async;  // Wakes up the loop to send the posted responses.
+  mutex posted_mu;
+  vector<pair<ResponseImpl*, Response::Code>> posted;     // Guarded by posted_mu.
+  vector<pair<ResponseImpl*, Response::Code>> sending;    // The batch being sent.
+};
+
+
+// Handles to the statistics updated for every request.
+struct ServerVarz {
+  explicit ServerVarz(Varz &varz);
+
+  Counter connection_alloc;
+  Counter connection_dealloc;
+  Counter on_message_complete;
+  Counter response_impl_alloc;
+  Counter response_impl_dealloc;
+  Counter response_send;
+  Counter send_buffer_alloc;
+  Counter send_buffer_dealloc;
+  Counter sent_bytes;
+  Counter cache_hit;
+  Counter cache_miss;
+  Counter cache_store;
+  Counter cache_eviction;
+  Counter cache_invalidation;
+  Counter revalidation;
+  Counter not_modified;
+  Counter compression_in_bytes;
+  Counter compression_out_bytes;
+  Counter compression_offloaded;
+  Counter rejected_header;
+  Counter rejected_body;
+  Counter rejected_malformed;
+  Counter shed_connection;
+  Counter shed_pipelined;
+  Counter shed_in_flight;
+  Counter offloaded;
+  Counter shed_offload;
+  Counter posted_send;
+  Counter posted_batch;
+  Counter write;
+  Histogram response;
+};
+
+// Content codings of the response body, as a mask for Accept-Encoding.
+enum Encoding {
+  ENCODING_GZIP = 1,
+  ENCODING_DEFLATE = 2,
+};
+
+// A response kept by the ResponseCache, immutable once stored.
+struct CachedResponse {
+  string head;              // Status line and headers, except Date and Age.
+  string body;
+  string encoded_head;      // The compressed variant, if encoding is not 0.
+  string encoded_body;
+  int encoding;
+  time_t stored;
+  time_t expires;
+  string etag;              // The validators, for conditional requests.
+  time_t last_modified;
+};
+
+// Serialized responses to GET requests, shared by the workers. The cache is
+// split into shards with their own lock and memory bound; each shard evicts
+// with the CLOCK algorithm: the hand skips (and clears) the entries hit since
+// its previous pass and evicts the first one that was not.
+class ResponseCache {
+ public:
+  ResponseCache(size_t max_bytes, const vector<string> &key_headers, ServerVarz &stats);
+
+  // Builds the key of the request: the URL followed by the key header values
+  // and the encoding the client gets for a compressed response, so that the
+  // responses stored for clients without gzip are not sent to the others.
+  void key_of(Request &req, int accept_encoding, string &key);
+
+  // Returns the fresh response for the key, or null.
+  shared_ptr<const CachedResponse> lookup(const string &key, time_t now);
+
+  void store(const string &key, shared_ptr<const CachedResponse> res);
+
+  // Removes the responses whose key starts with url_prefix.
+  void invalidate(const string &url_prefix);
+
+  // Exports the number of entries and bytes.
+  void export_to(Varz &varz);
+
+ private:
+  static constexpr int NUM_SHARDS = 16;
+
+  struct Entry {
+    const string *key;      // Owned by Shard::index.
+    shared_ptr<const CachedResponse> response;
+    size_t bytes;
+    bool referenced;        // Hit since the hand last passed.
+  };
+
+  struct Shard {
+    mutex mu;
+    std::list<Entry> ring;
+    std::list<Entry>::iterator hand;
+    std::unordered_map<string, std::list<Entry>::iterator> index;
+    size_t bytes;
+  };
+
+  Shard& shard_of(const string &key) { return shards[std::hash<string>()(key) % NUM_SHARDS]; }
+  void remove(Shard &s, std::list<Entry>::iterator it);
+
+  const size_t max_shard_bytes;
+  const vector<string> key_headers;
+  ServerVarz &stats;
+  Shard shards[NUM_SHARDS];
+};
+
+// A regular file mapped into memory, shared by the responses sending it.
+struct MappedFile {
+  MappedFile(): data(nullptr), size(0), mtime(0) {}
+  ~MappedFile() { if (data) munmap((void*) data, size); }
+
+  const char *data;         // Null for an empty file.
+  size_t size;
+  time_t mtime;
+  string etag;
+  const char *content_type;
+};
+
+// The files sent by Response::send_file(), mapped once and checked for
+// changes (stat) at most once per second.
+class FileCache {
+ public:
+  static constexpr size_t MAX_FILES = 1024;
+
+  // Returns null if the path is not a readable regular file.
+  shared_ptr<const MappedFile> open(const string &path);
+
+ private:
+  struct Entry {
+    shared_ptr<const MappedFile> file;
+    time_t checked;         // When the file was last stat'ed.
+  };
+
+  mutex mu;
+  std::unordered_map<string, Entry> files;
+};
+
+// A cap on the requests not yet answered whose URL starts with prefix.
+struct InFlightLimit {
+  InFlightLimit(const string &prefix, int max): prefix(prefix), max(max), count(0) {}
+
+  const string prefix;
+  const int max;
+  std::atomic<int> count;   // Over all the workers.
+};
+
+// A request handed to the HandlerPool. The headers and the body are copied
+// into data since the views of the parsed request do not outlive the read.
+struct OffloadedRequest {
+  Route *route;
+  ResponseImpl *res;
+  Request req;
+  string data;              // The header names and values, then the body.
 };
 
+// A bounded pool of threads running the handlers of the offloaded routes, see
+// Server::offload(). Their responses are sent back to the loop of the
+// connection by ResponseImpl::send().
+class HandlerPool {
+ public:
+  HandlerPool(): max_queued(0), stopping(false) {}
+  ~HandlerPool();
+
+  void start(int num_threads, size_t max_queued);
+
+  // Returns false without queueing when max_queued requests are waiting.
+  bool submit(unique_ptr<OffloadedRequest> r);
+  size_t queued();
+
+ private:
+  void run();
+
+  size_t max_queued;
+  bool stopping;
+  mutex mu;
+  std::condition_variable ready;
+  deque<unique_ptr<OffloadedRequest>> tasks;   // Guarded by mu.
+  vector<std::thread> threads;
+};
 
 class ServerImpl {
  public:
   ServerImpl();
-  void get(string path, Handler handler);
-  void listen(string address, int port);
-
-  vector<pair<string, Handler>> handlers;
+  void route(Method method, string pattern, Handler handler);
+  void offload(Method method, string pattern, Handler handler);
+  void stream(Method method, string pattern, StreamHandler handler);
+  void static_dir(const string &prefix, const string &root, int max_age);
+  void listen(string address, int port, int num_workers, bool pin_cpus);
+
+  size_t pool_capacity;     // Maximum number of free objects per pool per worker.
+  Router router;
+  vector<unique_ptr<Worker>> workers;
   Varz varz;
+  ServerVarz stats;
+  unique_ptr<ResponseCache> cache;  // Null unless enabled.
+  FileCache files;
+  bool compression;
+  size_t compression_min_size;      // Smaller bodies are sent as they are.
+  int compression_level;
+  size_t compression_offload_size;  // Larger bodies are compressed on the thread pool.
+  size_t max_header_size;
+  size_t max_body_size;             // Of the buffered bodies.
+  bool has_stream_routes;
+  int max_connections;              // Admission limits, 0 for none.
+  int max_pipelined;
+  int retry_after_s;
+  int backlog;
+  size_t max_write_batch;           // Bytes of responses written at once.
+  IoEngine io_engine;
+  vector<unique_ptr<InFlightLimit>> in_flight_limits;
+  vector<string> priority_prefixes; // Never shed.
+  std::atomic<int> num_connections; // Open, over all the workers.
+  const string unknown_prefix;      // For the responses without a route.
+  Histogram unknown_latency;
+  bool has_offload_routes;
+  int offload_threads;              // 0 for one per CPU.
+  size_t offload_max_queued;
+  HandlerPool handler_pool;         // Last, its threads stop first.
 };
 
 
@@ -103,6 +1060,32 @@ enum class HttpParserState {
 
 constexpr int MAX_BUFFER_LEN = 64 * 1024;
 
+struct ReadBuffer {
+  ReadBuffer() {}           // Not zeroed when created by a Pool.
+  char data[MAX_BUFFER_LEN];
+};
+
+// The read buffers of all the connections on the current thread's loop.
+// A buffer is only lent for the duration of one on_read: HttpParser copies
+// what it still needs from it, so idle connections do not hold a buffer.
+static Pool<ReadBuffer>& read_buffers() {
+  static thread_local Pool<ReadBuffer> pool;
+  return pool;
+}
+
+// A part of the message being parsed (URL, header name or value, body). It is
+// a view into the read buffer while the part arrives in one piece, and is copied
+// into one of the parser's reusable strings when it spans several reads.
+struct MessagePart {
+  MessagePart(): p(nullptr), len(0), slot(-1) {}
+
+  const char *p;    // Start of the view when slot < 0.
+  size_t len;
+  int slot;         // Index of the copy in HttpParser::copies, or -1.
+};
+
+class UringSocket;
+
 class HttpParser {
  public:
   HttpParser();
@@ -121,79 +1104,404 @@ class HttpParser {
   int append_header_field(const char *p, size_t len);
   int append_header_value(const char *p, size_t len);
   int append_body(const char *p, size_t len);
+  int reject(int status);               // Stops parsing, answered through reject_cb.
 
   bool parse(const char *buf, ssize_t nread);
+  void fail();                          // Rejects or closes after a parse error.
+  void pause();                         // Stops reading until resume().
+  void resume();
 
   void reset();                         // Prepare the HttpParser for the next request.
   void build_request();                 // Make the request ready for consumption.
   void close();
+  void closed();                        // Called once the stream is closed.
+  bool closing();                       // Or closed.
+  void read_start();
+  void read_stop();
+
+  void append(MessagePart &part, const char *p, size_t len);
+  void copy(MessagePart &part);         // Copies a view before the read buffer is reused.
+  StringView view(const MessagePart &part);
+  int new_copy();
 
   uv_stream_t* tcp;                     // Not owned, passed in through start(), used for close().
+  UringSocket* uring;                   // Instead of tcp with the io_uring engine, or null.
   http_parser_settings parser_settings; // Built-in implementation of parsing http requests.
-  char buffer[MAX_BUFFER_LEN];          // Reading buffer.
-  ostringstream temp_hf_;               // Header field.
-  ostringstream temp_hv_;               // Header value.
-  ostringstream url_;                   // Request URL.
-  ostringstream body_;                  // Request body.
+  MessagePart url_;                     // Request URL.
+  vector<pair<MessagePart, MessagePart>> headers_; // Header fields and values.
+  MessagePart body_;                    // Request body.
+  vector<string> copies;                // Parts spanning several reads, reused.
+  int num_copies;                       // Number of copies used by the current message.
+  bool in_message;                      // Whether a message is partially parsed.
   http_parser parser;                   // HTTP parser to parse the client http requests.
   Request request;                      // Previous Calls to parse() are used to build this Request.
   function<void(Request&)> msg_cb; // Callback on message complete.
   function<void()> close_cb;       // Callback on close.
   HttpParserState state;                // The state of the current parsing request.
+
+  size_t max_header_size;               // Limits of one message, 0 for none.
+  size_t max_body_size;
+  size_t header_size;                   // Bytes of URL and headers of the current message.
+  size_t body_size;
+  int rejected;                         // HTTP status of a rejected message, or 0.
+  function<void(int)> reject_cb;        // Answers a rejected message, closes if not set.
+  function<bool(Request&)> headers_cb;  // Returns true to stream the body to body_stream.
+  BodyStream body_stream;
+  bool streaming_body;                  // Whether the body goes to body_stream.
+  bool paused;
+  bool parsing;                         // Inside http_parser_execute.
+  string held;                          // Input left unparsed while paused.
+};
+
+
+#ifdef SIMPLE_HTTP_IO_URING
+
+// An operation in flight, found through the user_data of its completions.
+struct UringOp {
+  enum Type { ACCEPT, RECV, SEND };
+  Type type;
+  UringSocket *socket;      // Null for ACCEPT.
+};
+
+// A connection of the io_uring engine, standing in for the uv_tcp_t of the
+// libuv engine: the data received goes to the parser, the writes complete
+// with their uv_write_cb and close() completes on a later loop iteration,
+// once the operations in flight are done.
+class UringSocket {
+ public:
+  UringSocket();
+
+  void open(IoRing *ring, int fd, HttpParser *parser);
+  void read_start();
+  void read_stop();
+  int write(uv_write_t *req, const uv_buf_t bufs[], unsigned nbufs, uv_write_cb cb);
+  void close();
+  bool closing() { return closing_; }
+
+  void on_complete(UringOp *op, int res, unsigned flags);
+  void finish_close();      // Called by the ring once nothing is in flight.
+
+ private:
+  struct Write {
+    uv_write_t *req;
+    uv_write_cb cb;
+    vector<struct iovec> iov;
+    size_t next;            // The first iovec not entirely sent.
+  };
+
+  void arm_recv();
+  void on_recv(int res, unsigned flags);
+  void send_next();
+  void on_send(int res);
+  void cancel(UringOp *op);
+  void maybe_closed();
+
+  IoRing *ring;             // Not owned.
+  int fd;
+  HttpParser *parser;       // Not owned.
+  UringOp recv_op;
+  UringOp send_op;
+  bool reading;             // Between read_start() and read_stop().
+  bool recv_armed;          // A recv is in flight.
+  bool sending;             // The sendmsg of the first write is in flight.
+  bool closing_;
+  bool close_queued;
+  int in_flight;            // Operations whose last completion did not arrive.
+  deque<Write> writes;
+  struct msghdr msg;        // Of the sendmsg in flight.
+};
+
+// The io_uring instance of a worker. Its completions are signalled through
+// an eventfd polled by the libuv loop, and the entries prepared during a
+// loop iteration are submitted together before the loop waits again.
+class IoRing {
+ public:
+  static constexpr unsigned SQ_ENTRIES = 1024;
+  static constexpr unsigned CQ_ENTRIES = 8192;
+  static constexpr unsigned NUM_BUFFERS = 512;          // Power of two.
+  static constexpr unsigned BUFFER_SIZE = 16 * 1024;
+  static constexpr unsigned BUFFER_GROUP = 0;
+
+  // Returns null, after logging why, if io_uring or one of the features
+  // used is not available.
+  static IoRing* create(Worker *worker);
+  ~IoRing();
+
+  void accept(int listen_fd);   // Arms the multishot accept.
+  void on_event();              // The eventfd signals completions.
+  struct io_uring_sqe* get_sqe();
+  void submit();
+  void reap();
+
+  const char* buffer(unsigned id) { return buffers + (size_t) id * BUFFER_SIZE; }
+  void recycle_buffer(unsigned id);
+
+  // Queues the socket to be closed on the next loop iteration.
+  void closed(UringSocket *socket) { closed_sockets.push_back(socket); }
+  void close_sockets();
+
+  bool multishot_recv;          // Unless the kernel rejected it (before 6.0).
+
+ private:
+  explicit IoRing(Worker *worker);
+  bool init();
+  void on_accept(int res, unsigned flags);
+
+  Worker *worker;               // Not owned.
+  int ring_fd;
+  int event_fd;
+  int listen_fd;
+  UringOp accept_op;
+  void *ring_mem;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail;
+  unsigned sq_mask, sq_entries;
+  unsigned tail;                // Of the entries prepared.
+  unsigned submitted;           // Tail of the entries submitted.
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf *buf_ring;
+  unsigned short buf_tail;
+  char *buffers;
+  vector<UringSocket*> closed_sockets;
+  uv_poll_t poll;
+  uv_prepare_t prepare;
+  Counter submits;
+  Counter completions;
 };
 
+#endif
+
 
 // One Connection instance per client.
 // HTTP pipelining is supported.
 class Connection {
  public:
-  Connection(ServerImpl*);
+  Connection(Worker*);
   ~Connection();
 
+  Worker *worker;           // The worker whose loop accepted this connection.
   ServerImpl *server;       // The server that created this connection object.
-  ResponseImpl* create_response(string prefix);      // Returns a detached object for async response.
+  // Returns a detached object for async response, whose latency is added to the histogram.
+  ResponseImpl* create_response(const string *prefix, Histogram latency);
   void flush_responses();
+  void write_responses();   // Writes the ready responses at the head in one write.
+  void after_write(int status);
   bool disposeable();
+  bool closing() { return the_parser.closing(); }   // Or closed.
+  int write(uv_write_t *req, const uv_buf_t bufs[], unsigned nbufs, uv_write_cb cb);
   void cleanup();           // Flush all pending responses and destroy this connection if no longer used.
 
-  queue<ResponseImpl*> responses;
+  // Returns false after answering 503 if the request is over the admission
+  // limits, otherwise sets the in-flight limit counting the request, if any.
+  bool admit(Request &req, InFlightLimit **limit);
+
+  // Runs the handler of the offloaded route on the HandlerPool, or answers
+  // 503 when too many requests wait for it.
+  void offload(Route *route, Request &req, ResponseImpl *res);
+
+  deque<ResponseImpl*> responses;
+  size_t num_writing;       // Responses at the head being written.
+  uv_write_t write_req;
+  bool close_when_done;     // Close after the queued responses, e.g. a rejected request.
+  bool over_capacity;       // Opened beyond the maximum number of connections.
   uv_tcp_t handle;          // TCP connection handle to the client browser.
+#ifdef SIMPLE_HTTP_IO_URING
+  UringSocket uring;        // Instead of handle with the io_uring engine.
+#endif
   HttpParser the_parser;    // The parser for the TCP stream handle.
 };
 
 
-class ResponseImpl {
+// An output buffer for the response body that exposes its bytes, so that they
+// can be written to the socket without copying them out of an ostringstream.
+class BodyBuffer : public std::streambuf {
  public:
-  ostringstream body;
-  int max_age_s;
-  int max_runtime_ms;
-  int last_modified;
+  const char* data() { return pbase(); }
+  size_t size() { return pptr() - pbase(); }
+
+  // Replaces the content with s, reusing its storage.
+  void assign(string &&s) {
+    buf = std::move(s);
+    size_t n = buf.size();
+    buf.resize(buf.capacity());
+    reset(n);
+  }
+
+  // Moves the content out into s, leaving this buffer empty.
+  void take(string &s) {
+    buf.resize(size());
+    s.swap(buf);
+    buf.clear();
+    reset(0);
+  }
+
+ protected:
+  int_type overflow(int_type ch) override {
+    grow(1);
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char *p, std::streamsize n) override {
+    if (epptr() - pptr() < n) grow(n);
+    memcpy(pptr(), p, n);
+    advance(n);
+    return n;
+  }
+
+ private:
+  void grow(size_t n) {
+    size_t used = size();
+    buf.resize(max(max(used + n, buf.size() * 2), (size_t) 256));
+    reset(used);
+  }
+
+  // Points the put area at buf, with the first "used" bytes written.
+  void reset(size_t used) {
+    char *base = buf.empty() ? nullptr : &buf[0];
+    setp(base, base + buf.size());
+    advance(used);
+  }
+
+  void advance(size_t n) {
+    for (; n > INT_MAX; n -= INT_MAX) pbump(INT_MAX);
+    pbump((int) n);
+  }
 
-  ResponseImpl(Connection *con, string req_url);
+  string buf;
+};
+
+string ResponseBody::str() const {
+  BodyBuffer *buf = static_cast<BodyBuffer*>(rdbuf());
+  return string(buf->data(), buf->size());
+}
+
+void ResponseBody::str(const string &s) {
+  static_cast<BodyBuffer*>(rdbuf())->assign(string(s));
+}
+
+class ResponseImpl {
+ public:
+  BodyBuffer body_buffer;
+  ResponseBody body;
+  int max_age_s;
+  int max_runtime_ms;
+  int last_modified;
+  string cache_key;     // Where to store the response in the cache, if not empty.
+  shared_ptr<const CachedResponse> cached;   // The cache hit to send instead.
+  string etag;          // Quoted, with the W/ prefix when weak; empty if none.
+  string if_none_match;     // The validators of a conditional request.
+  time_t if_modified_since;
+  bool body_skipped;    // The handler did not produce the body, see not_modified().
+  bool head;            // A HEAD request: the headers are sent without the body.
+  string content_type;  // Empty for the default JSON.
+  int accept_encoding;  // The encodings accepted by the client, a mask of Encoding.
+  int encoding;         // The encoding of the body sent.
+  bool vary;            // Whether the body sent depends on Accept-Encoding.
+  string encoded;       // The compressed body.
+  shared_ptr<const MappedFile> file;    // Sent instead of the body, see send_file().
+  size_t file_offset;   // The range of the file sent.
+  size_t file_length;
+  string range;         // The Range and If-Range headers of the request.
+  string if_range;
+  bool streaming;       // The body is sent in chunks, see write_chunk().
+  bool header_sent;     // The header of a streamed response was written.
+  bool stream_writing;  // A write of stream_out is in progress.
+  bool stream_failed;   // A write failed, the client is gone.
+  bool ready;           // Flushed and waiting to be written by the connection.
+  string stream_out;    // The chunks being written.
+  string stream_pending;    // The chunks waiting for the write in progress.
+  function<void()> drain_cb;
+  std::atomic<int> *in_flight;  // The in-flight limit count to decrement, or null.
+
+  ResponseImpl(Connection *con, const string *prefix, Histogram latency);
   ~ResponseImpl();
 
+  // Copies what the response needs from the request headers (the validators
+  // of a conditional GET and the accepted encodings) as they do not outlive it.
+  void read_headers(Request &req);
+
+  // Whether the validators of the request match the response's.
+  bool validators_match(const string &etag, time_t last_modified);
+
   // In a pipelined response, this send request will be queued if it's not the head.
   void send(Response::Code code);
 
+  // Sends the file, or the requested range of it.
+  void send_file(const string &path);
+
   // Send the body to client then asynchronously call "cb".
+  // Large bodies are first compressed on the thread pool.
   void flush(uv_write_cb cb);
 
+  // Stores the response in the cache if it is cacheable, then writes it.
+  void write_response();
+
+  // Completes the header with the Date and makes the response ready to be
+  // written with the body by the connection, see Connection::write_responses().
+  void write(const char *body_data, size_t body_size);
+
+  // Appends the buffers of a ready response.
+  void append_bufs(vector<uv_buf_t> &bufs);
+  size_t ready_size() { return header.size() + out_size; }
+
+  // Appends the status line and the headers, except Date.
+  void append_head(string &h, size_t body_size, int encoding);
+
+  // Compresses the body into encoded, falling back to no encoding.
+  void compress();
+
+  // Queues the body and data as chunks, writing them if this response is
+  // the head of the pipeline. Returns false when the client is slow or gone.
+  bool write_chunk(const char *data, size_t size);
+
+  // Writes the queued chunks (after the header the first time) unless a
+  // write is in progress, then calls cb.
+  void pump(uv_write_cb cb);
+
+  // Called when a write of stream_out completes.
+  void after_stream_write(int status);
+
+  // Writes the last chunk and calls write_cb.
+  void end_stream();
+
+  // Whether the calling thread runs the loop of the connection. Only send()
+  // may be called elsewhere, the streaming methods may not.
+  bool on_loop();
+
   Connection* connection() { return c; }
   int get_state() { return state; }
   void finish() {
+    written();
+    stream_writing = false;   // The last chunk was written.
+    c->cleanup();
+  }
+  void written() {
     assert(state == 2);
     state = 3;
-    c->cleanup();
+    ready = false;
   }
 
  private:
   Connection *c; // Not owned.
-  string url;
+  const string *prefix; // The route pattern, not owned.
+  Histogram latency;
   time_point<high_resolution_clock> start_time;
-  uv_buf_t send_buffer;
+  string header;        // Status line and headers, the body is sent from body_buffer.
   int state; // 0 = initialized, 1 = after send(), 2 = after flush(), 3 = finished
   Response::Code code;
-  uv_write_t write_req;
+  const char *out_data; // The body of a ready response.
+  size_t out_size;
+  uv_write_t write_req; // Of the streamed chunks.
+  uv_write_cb write_cb;
+  uv_work_t work_req;   // To compress on the thread pool.
 };
 
 
@@ -203,17 +1511,121 @@ unsigned long long Varz::get(string key) { return impl->get(key); }
 void Varz::set(string key, unsigned long long value) { impl->set(key, value); }
 void Varz::inc(string key, unsigned long long value) { impl->inc(key, value); }
 void Varz::latency(string key, int us) { impl->latency(key, us); }
-void Varz::print_to(ostringstream &ss) { impl->print_to(ss); }
+void Varz::print_to(ostream &ss) { impl->print_to(ss); }
+void Varz::add_to(Varz &total) { impl->add_to(*total.impl); }
+Counter Varz::counter(const string &key) {
+  Counter c;
+  c.impl = impl.get();
+  c.slot = impl->slot_of(key, nullptr);
+  return c;
+}
+Histogram Varz::histogram(const string &key, int significant_digits) {
+  Histogram h;
+  h.impl = impl.get();
+  h.slot = impl->slot_of(key, &HdrLayout::get(significant_digits));
+  h.layout = impl->layout_of(key);
+  return h;
+}
+
+void Counter::inc(unsigned long long value) { impl->shard().add(slot, value); }
+void Counter::set(unsigned long long value) { impl->shard().set(slot, value); }
+void Histogram::add(int us) { impl->add_latency(slot, *layout, us); }
 
 
 
 Server::Server(): impl(unique_ptr<ServerImpl>(new ServerImpl())) {}
 Server::~Server() {}
-void Server::get(string prefix, Handler handler) { impl->get(prefix, handler); }
-void Server::listen(string address, int port) { impl->listen(address, port); }
+void Server::get(string pattern, Handler handler) { impl->route(Method::GET, pattern, handler); }
+void Server::post(string pattern, Handler handler) { impl->route(Method::POST, pattern, handler); }
+void Server::options(string pattern, Handler handler) { impl->route(Method::OPTIONS, pattern, handler); }
+void Server::route(Method method, string pattern, Handler handler) { impl->route(method, pattern, handler); }
+void Server::offload(Method method, string pattern, Handler handler) { impl->offload(method, pattern, handler); }
+void Server::set_offload_threads(int num_threads, size_t max_queued) {
+  assert(impl->workers.empty());
+  assert(num_threads >= 0 && max_queued > 0);
+  impl->offload_threads = num_threads;
+  impl->offload_max_queued = max_queued;
+}
+void Server::set_pool_capacity(int max_free_objects) { impl->pool_capacity = max_free_objects; }
+void Server::enable_cache(size_t max_bytes, vector<string> key_headers) {
+  assert(impl->workers.empty());
+  impl->cache.reset(new ResponseCache(max_bytes, key_headers, impl->stats));
+}
+void Server::stream(Method method, string pattern, StreamHandler handler) { impl->stream(method, pattern, handler); }
+void Server::static_dir(string prefix, string root, int max_age) { impl->static_dir(prefix, root, max_age); }
+void Server::set_request_limits(size_t max_header_size, size_t max_body_size) {
+  assert(impl->workers.empty());
+  impl->max_header_size = max_header_size;
+  impl->max_body_size = max_body_size;
+}
+void Server::set_admission_limits(int max_connections, int max_pipelined, int retry_after_s) {
+  assert(impl->workers.empty());
+  impl->max_connections = max_connections;
+  impl->max_pipelined = max_pipelined;
+  impl->retry_after_s = retry_after_s;
+}
+void Server::limit_in_flight(string url_prefix, int max_in_flight) {
+  assert(impl->workers.empty());
+  impl->in_flight_limits.emplace_back(new InFlightLimit(url_prefix, max_in_flight));
+}
+void Server::add_priority_prefix(string url_prefix) {
+  assert(impl->workers.empty());
+  impl->priority_prefixes.push_back(url_prefix);
+}
+void Server::set_listen_backlog(int backlog) {
+  assert(impl->workers.empty());
+  impl->backlog = backlog;
+}
+void Server::set_io_engine(IoEngine engine) {
+  assert(impl->workers.empty());
+  impl->io_engine = engine;
+}
+void Server::set_write_batch_limit(size_t max_bytes) {
+  assert(impl->workers.empty());
+  impl->max_write_batch = max_bytes;
+}
+void Server::enable_compression(size_t min_size, int level, size_t offload_size) {
+  assert(impl->workers.empty());
+  assert(level >= 1 && level <= 9);
+  impl->compression = true;
+  impl->compression_min_size = min_size;
+  impl->compression_level = level;
+  impl->compression_offload_size = offload_size;
+}
+void Server::invalidate_cache(const string &url_prefix) {
+  if (impl->cache) impl->cache->invalidate(url_prefix);
+}
+void Server::listen(string address, int port) { impl->listen(address, port, 1, false); }
+void Server::listen(string address, int port, int num_workers, bool pin_cpus) {
+  impl->listen(address, port, num_workers, pin_cpus);
+}
 Varz* Server::varz() { return &impl->varz; }
 
 
+StringView Headers::get(StringView name) const {
+  for (auto &h : views) {
+    if (h.name.equals_ignore_case(name)) return h.value;
+  }
+  return StringView();
+}
+
+void Headers::clear() {
+  views.clear();
+  if (copied) {
+    copies.clear();
+    copied = false;
+  }
+}
+
+map<string, string>& Headers::as_map() {
+  if (!copied) {
+    for (auto &h : views) copies[h.name.str()] = h.value.str();
+    copied = true;
+  }
+  return copies;
+}
+
+
 Response::Response(ResponseImpl *r): impl(r) {}
 Response::~Response() {}
 void Response::set_max_age(int seconds, int last_modified) {
@@ -221,6 +1633,21 @@ void Response::set_max_age(int seconds, int last_modified) {
   impl->max_age_s = seconds;
   impl->last_modified = last_modified;
 }
+void Response::set_etag(const string &etag, bool weak) {
+  assert(impl);
+  impl->etag.assign(weak ? "W/\"" : "\"");
+  impl->etag.append(etag);
+  impl->etag.push_back('"');
+}
+bool Response::not_modified() {
+  assert(impl);
+  impl->body_skipped = impl->validators_match(impl->etag, impl->last_modified);
+  return impl->body_skipped;
+}
+void Response::set_content_type(const string &content_type) {
+  assert(impl);
+  impl->content_type = content_type;
+}
 void Response::set_max_runtime_warning(int milliseconds) {
   assert(impl);
   impl->max_runtime_ms = milliseconds;
@@ -230,56 +1657,459 @@ void Response::send(Code code) {
   impl->send(code);
   impl = nullptr;
 }
-ostringstream& Response::body() { assert(impl); return impl->body; }
+bool Response::write_chunk(const char *data, size_t size) {
+  assert(impl && impl->on_loop());
+  return impl->write_chunk(data, size);
+}
+void Response::on_drain(function<void()> callback) {
+  assert(impl && impl->on_loop());
+  impl->drain_cb = callback;
+}
+bool Response::closed() {
+  assert(impl && impl->on_loop());
+  return impl->stream_failed || impl->connection()->closing();
+}
+void Response::end() {
+  assert(impl && impl->on_loop());
+  impl->streaming = true;
+  impl->send(Code::OK);
+  impl = nullptr;
+}
+void Response::send_file(const string &path) {
+  assert(impl);
+  impl->send_file(path);
+  impl = nullptr;
+}
+ResponseBody& Response::body() { assert(impl); return impl->body; }
+void Response::set_body(string body) { assert(impl); impl->body_buffer.assign(std::move(body)); }
+
+
+
+// The worker whose loop is running on the current thread, if any.
+static thread_local Worker* current_worker = nullptr;
+
+ServerVarz::ServerVarz(Varz &varz):
+  connection_alloc(varz.counter("server_connection_alloc")),
+  connection_dealloc(varz.counter("server_connection_dealloc")),
+  on_message_complete(varz.counter("server_on_message_complete")),
+  response_impl_alloc(varz.counter("server_response_impl_alloc")),
+  response_impl_dealloc(varz.counter("server_response_impl_dealloc")),
+  response_send(varz.counter("server_response_send")),
+  send_buffer_alloc(varz.counter("server_send_buffer_alloc")),
+  send_buffer_dealloc(varz.counter("server_send_buffer_dealloc")),
+  sent_bytes(varz.counter("server_sent_bytes")),
+  cache_hit(varz.counter("server_cache_hit")),
+  cache_miss(varz.counter("server_cache_miss")),
+  cache_store(varz.counter("server_cache_store")),
+  cache_eviction(varz.counter("server_cache_eviction")),
+  cache_invalidation(varz.counter("server_cache_invalidation")),
+  revalidation(varz.counter("server_revalidation")),
+  not_modified(varz.counter("server_not_modified")),
+  compression_in_bytes(varz.counter("server_compression_in_bytes")),
+  compression_out_bytes(varz.counter("server_compression_out_bytes")),
+  compression_offloaded(varz.counter("server_compression_offloaded")),
+  rejected_header(varz.counter("server_rejected_header")),
+  rejected_body(varz.counter("server_rejected_body")),
+  rejected_malformed(varz.counter("server_rejected_malformed")),
+  shed_connection(varz.counter("server_shed_connection")),
+  shed_pipelined(varz.counter("server_shed_pipelined")),
+  shed_in_flight(varz.counter("server_shed_in_flight")),
+  offloaded(varz.counter("server_offloaded")),
+  shed_offload(varz.counter("server_shed_offload")),
+  posted_send(varz.counter("server_posted_send")),
+  posted_batch(varz.counter("server_posted_batch")),
+  write(varz.counter("server_write")),
+  response(varz.histogram("server_response")) {}
+
+ResponseCache::ResponseCache(size_t max_bytes, const vector<string> &key_headers, ServerVarz &stats):
+    max_shard_bytes(max_bytes / NUM_SHARDS), key_headers(key_headers), stats(stats) {
+  for (auto &s : shards) {
+    s.hand = s.ring.end();
+    s.bytes = 0;
+  }
+}
+
+void ResponseCache::key_of(Request &req, int accept_encoding, string &key) {
+  key.assign(req.url);
+  for (auto &name : key_headers) {
+    StringView value = req.headers.get(name);
+    key.push_back('\n');
+    key.append(value.data(), value.size());
+  }
+  // Gzip is preferred, see ResponseImpl::flush().
+  key.push_back('\n');
+  key.push_back((accept_encoding & ENCODING_GZIP) ? 'g' : (accept_encoding & ENCODING_DEFLATE) ? 'd' : 'i');
+}
+
+shared_ptr<const CachedResponse> ResponseCache::lookup(const string &key, time_t now) {
+  Shard &s = shard_of(key);
+  lock_guard<mutex> lock(s.mu);
+  auto it = s.index.find(key);
+  if (it == s.index.end()) {
+    stats.cache_miss.inc();
+    return nullptr;
+  }
+  Entry &e = *it->second;
+  if (e.response->expires <= now) {
+    remove(s, it->second);
+    stats.cache_miss.inc();
+    return nullptr;
+  }
+  e.referenced = true;
+  stats.cache_hit.inc();
+  return e.response;
+}
+
+// The memory held by an entry: the key twice (index and ring) and every
+// string of the response, with its compressed variant.
+static size_t cached_bytes(const string &key, const CachedResponse &res) {
+  return 2 * key.capacity() + res.head.capacity() + res.body.capacity() +
+    res.encoded_head.capacity() + res.encoded_body.capacity() + res.etag.capacity() +
+    sizeof(CachedResponse) + 64;
+}
+
+void ResponseCache::store(const string &key, shared_ptr<const CachedResponse> res) {
+  size_t bytes = cached_bytes(key, *res);
+  if (bytes > max_shard_bytes) return;
+  Shard &s = shard_of(key);
+  lock_guard<mutex> lock(s.mu);
+  auto it = s.index.find(key);
+  if (it != s.index.end()) remove(s, it->second);
+  it = s.index.insert(make_pair(key, s.ring.end())).first;
+  // Behind the hand, i.e. the last to be considered for eviction.
+  it->second = s.ring.insert(s.hand, Entry { &it->first, std::move(res), bytes, false });
+  s.bytes += bytes;
+  stats.cache_store.inc();
+  time_t now = time(NULL);
+  while (s.bytes > max_shard_bytes) {
+    if (s.hand == s.ring.end()) s.hand = s.ring.begin();
+    if (s.hand->referenced && s.hand->response->expires > now) {
+      s.hand->referenced = false;
+      ++s.hand;
+      continue;
+    }
+    remove(s, s.hand);
+    stats.cache_eviction.inc();
+  }
+}
+
+void ResponseCache::invalidate(const string &url_prefix) {
+  for (auto &s : shards) {
+    lock_guard<mutex> lock(s.mu);
+    for (auto it = s.ring.begin(); it != s.ring.end(); ) {
+      auto next = std::next(it);
+      if (!it->key->compare(0, url_prefix.size(), url_prefix)) {
+        remove(s, it);
+        stats.cache_invalidation.inc();
+      }
+      it = next;
+    }
+  }
+}
+
+void ResponseCache::remove(Shard &s, std::list<Entry>::iterator it) {
+  if (s.hand == it) ++s.hand;
+  s.bytes -= it->bytes;
+  s.index.erase(*it->key);
+  s.ring.erase(it);
+}
+
+void ResponseCache::export_to(Varz &varz) {
+  size_t entries = 0, bytes = 0;
+  for (auto &s : shards) {
+    lock_guard<mutex> lock(s.mu);
+    entries += s.ring.size();
+    bytes += s.bytes;
+  }
+  varz.set("server_cache_entries", entries);
+  varz.set("server_cache_bytes", bytes);
+}
+
+static const char* content_type_of(const string &path) {
+  static const map<string, const char*> types = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" },
+    { "js", "application/javascript; charset=utf-8" },
+    { "json", "application/json; charset=utf-8" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "xml", "application/xml; charset=utf-8" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "ico", "image/x-icon" },
+    { "webp", "image/webp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "pdf", "application/pdf" },
+    { "wasm", "application/wasm" },
+    { "mp4", "video/mp4" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+  };
+  size_t dot = path.rfind('.');
+  if (dot != string::npos && path.find('/', dot) == string::npos) {
+    string ext = path.substr(dot + 1);
+    for (auto &ch : ext) ch = tolower((unsigned char) ch);
+    auto it = types.find(ext);
+    if (it != types.end()) return it->second;
+  }
+  return "application/octet-stream";
+}
+
+shared_ptr<const MappedFile> FileCache::open(const string &path) {
+  time_t now = time(NULL);
+  {
+    lock_guard<mutex> lock(mu);
+    auto it = files.find(path);
+    if (it != files.end() && it->second.checked == now) return it->second.file;
+  }
+  struct stat st;
+  if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+    lock_guard<mutex> lock(mu);
+    files.erase(path);
+    return nullptr;
+  }
+  {
+    lock_guard<mutex> lock(mu);
+    auto it = files.find(path);
+    if (it != files.end() && (off_t) it->second.file->size == st.st_size && it->second.file->mtime == st.st_mtime) {
+      it->second.checked = now;
+      return it->second.file;
+    }
+  }
+
+  // New or changed: map it outside the lock.
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return nullptr;
+  shared_ptr<MappedFile> f = std::make_shared<MappedFile>();
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    return nullptr;
+  }
+  f->size = st.st_size;
+  f->mtime = st.st_mtime;
+  if (f->size) {
+    void *p = mmap(nullptr, f->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      Log::warn("Could not map %s", path.c_str());
+      return nullptr;
+    }
+    madvise(p, f->size, MADV_SEQUENTIAL);
+    f->data = (const char*) p;
+  }
+  ::close(fd);
+  char etag[48];
+  snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long) f->mtime, (unsigned long long) f->size);
+  f->etag = etag;
+  f->content_type = content_type_of(path);
+
+  lock_guard<mutex> lock(mu);
+  if (files.size() >= MAX_FILES && !files.count(path)) files.erase(files.begin());
+  files[path] = Entry { f, now };
+  return f;
+}
 
+// Decodes the %XX escapes of a URL path. Returns false for a malformed path,
+// or one that could escape the root directory.
+static bool decode_path(const char *p, size_t n, string &path) {
+  path.clear();
+  for (size_t i = 0; i < n; i++) {
+    if (p[i] == '%') {
+      if (i + 2 >= n) return false;
+      if (!isxdigit((unsigned char) p[i + 1]) || !isxdigit((unsigned char) p[i + 2])) return false;
+      char hex[3] = { p[i + 1], p[i + 2], 0 };
+      path.push_back((char) strtol(hex, nullptr, 16));
+      i += 2;
+    } else {
+      path.push_back(p[i]);
+    }
+  }
+  if (path.find('\0') != string::npos) return false;
+  for (size_t i = 0; i < path.size(); ) {
+    size_t j = path.find('/', i);
+    if (j == string::npos) j = path.size();
+    if (!path.compare(i, j - i, "..")) return false;
+    i = j + 1;
+  }
+  return true;
+}
 
+void ServerImpl::static_dir(const string &prefix, const string &root, int max_age) {
+  route(Method::GET, prefix, [this, prefix, root, max_age](Request &req, Response &res) {
+    // Decoded once from the URL as received, which Request::url already is:
+    // "%2520" names "%20" and "%3F" is part of the name, not the query.
+    StringView raw = req.raw_url;
+    size_t end = 0;
+    while (end < raw.size() && raw[end] != '?' && raw[end] != '#') end++;
+    string path;
+    if (!decode_path(raw.data(), end, path) || path.compare(0, prefix.size(), prefix)) {
+      res.body() << "Invalid path " << req.url;
+      return res.send(Response::Code::NOT_FOUND);
+    }
+    path.erase(0, prefix.size());   // The part after the matched route.
+    if (path.empty() || path.back() == '/') path += "index.html";
+    if (path[0] != '/' && root.back() != '/') path.insert(0, 1, '/');
+    if (max_age > 0) res.set_max_age(max_age);
+    res.send_file(root + path);
+  });
+}
 
-ServerImpl::ServerImpl() {
-  get("/varz", [&](Request& req, Response& res) {
+ServerImpl::ServerImpl():
+    pool_capacity(1024),
+    stats(varz),
+    compression(false),
+    compression_min_size(0),
+    compression_level(Z_DEFAULT_COMPRESSION),
+    compression_offload_size(0),
+    max_header_size(64 * 1024),
+    max_body_size(64 * 1024 * 1024),
+    has_stream_routes(false),
+    max_connections(0),
+    max_pipelined(0),
+    retry_after_s(1),
+    backlog(128),
+    max_write_batch(256 * 1024),
+    io_engine(IoEngine::LIBUV),
+    priority_prefixes{"/varz"},
+    num_connections(0),
+    unknown_prefix("/unknown"),
+    unknown_latency(varz.histogram(unknown_prefix)),
+    has_offload_routes(false),
+    offload_threads(0),
+    offload_max_queued(1024) {
+  route(Method::GET, "/varz", [&](Request& req, Response& res) {
     varz.print_to(res.body());
     res.send();
   });
 }
 
-static bool is_prefix_of(const string &prefix, const string &str) {
-  auto res = std::mismatch(prefix.begin(), prefix.end(), str.begin());
-  return res.first == prefix.end();
+void ServerImpl::route(Method method, string pattern, Handler handler) {
+  router.add(method, pattern, handler)->latency = varz.histogram(pattern);
 }
 
-void ServerImpl::get(string path, Handler handler) {
-  for (auto &it : handlers) {
-    if (is_prefix_of(it.first, path)) {
-      Log::severe("Path '%s' cannot be the prefix of path '%s'", it.first.c_str(), path.c_str());
-      abort();
-    }
-  }
-  handlers.push_back(make_pair(path, handler));
+void ServerImpl::offload(Method method, string pattern, Handler handler) {
+  Route *r = router.add(method, pattern, handler);
+  r->offload = true;
+  r->latency = varz.histogram(pattern);
+  has_offload_routes = true;
+}
+
+void ServerImpl::stream(Method method, string pattern, StreamHandler handler) {
+  Route *r = router.add(method, pattern, Handler());
+  r->stream_handler = handler;
+  r->latency = varz.histogram(pattern);
+  has_stream_routes = true;
+}
+
+static Connection* new_connection(Worker *worker) {
+  Connection* c = worker->connection_pool.create(worker);
+  c->server->stats.connection_alloc.inc();
+  int max_connections = c->server->max_connections;
+  int n = c->server->num_connections.fetch_add(1, std::memory_order_relaxed);
+  c->over_capacity = max_connections && n >= max_connections;
+  return c;
+}
+
+static void serve(Connection *c, uv_stream_t *stream);
+
+// Returns a connection that was never served to the pool.
+static void on_unaccepted_close(uv_handle_t *handle) {
+  Connection *c = static_cast<Connection*>(handle->data);
+  c->server->stats.connection_dealloc.inc();
+  c->server->num_connections.fetch_sub(1, std::memory_order_relaxed);
+  c->worker->connection_pool.destroy(c);
 }
 
 static void on_connect(uv_stream_t* server_handle, int status) {
-  ServerImpl *server = static_cast<ServerImpl*>(server_handle->data);
-  assert(server && !status);
-  Connection* c = new Connection(server);
-  c->server->varz.inc("server_connection_alloc");
-  uv_tcp_init(uv_default_loop(), &c->handle);
+  Worker *worker = static_cast<Worker*>(server_handle->data);
+  assert(worker);
+  static Log::RateLimit failed_accepts(1000);
+  if (status) {
+    failed_accepts.warn("Failed accepting a connection: %s", uv_strerror(status));
+    return;
+  }
+  Connection* c = new_connection(worker);
+  uv_tcp_init(worker->loop, &c->handle);
   status = uv_accept(server_handle, (uv_stream_t*) &c->handle);
-  assert(!status);
+  if (status) {
+    // EAGAIN when the workers share the listening socket (no SO_REUSEPORT)
+    // and another one took the connection.
+    if (status != UV_EAGAIN) failed_accepts.warn("Failed accepting a connection: %s", uv_strerror(status));
+    uv_close((uv_handle_t*) &c->handle, on_unaccepted_close);
+    return;
+  }
+  serve(c, (uv_stream_t*) &c->handle);
+}
 
-  c->the_parser.start((uv_stream_t*) &c->handle, HTTP_REQUEST,
+#ifdef SIMPLE_HTTP_IO_URING
+static void on_uring_connect(Worker *worker, int fd) {
+  Connection* c = new_connection(worker);
+  c->uring.open(worker->ring.get(), fd, &c->the_parser);
+  c->the_parser.uring = &c->uring;
+  serve(c, nullptr);
+}
+#endif
+
+// Reads the requests of the connection from the stream (or its uring socket)
+// and answers them.
+static void serve(Connection *c, uv_stream_t *stream) {
+  c->the_parser.start(stream, HTTP_REQUEST,
     [c](Request &req) {
       // On message complete.
       // Log::info("message complete con %p, the_parser = %p, url = %s", c, &c->the_parser, req.url.c_str());
-      c->server->varz.inc("server_on_message_complete");
-      for (auto &it : c->server->handlers) {
-        if (is_prefix_of(it.first, req.url)) {
-          // Handle the request.
-          Response res { c->create_response(it.first) };
-          it.second(req, res);
+      c->server->stats.on_message_complete.inc();
+      InFlightLimit *limit;
+      if (!c->admit(req, &limit)) return;
+      bool other_method = false;
+      Route *route = c->server->router.match(req, &other_method);
+      if (route) {
+        ResponseImpl *impl = c->create_response(&route->pattern, route->latency);
+        if (limit) impl->in_flight = &limit->count;
+        impl->read_headers(req);
+        ResponseCache *cache = c->server->cache.get();
+        if (cache && req.method == Method::GET && !route->stream_handler) {
+          // A hit is sent without calling the handler, a miss may be stored.
+          cache->key_of(req, impl->accept_encoding, impl->cache_key);
+          auto hit = cache->lookup(impl->cache_key, time(NULL));
+          if (hit) {
+            impl->cached = std::move(hit);
+            impl->send(Response::Code::OK);
+            return;
+          }
+        }
+        // Handle the request.
+        Response res { impl };
+        if (route->offload) return c->offload(route, req, impl);
+        if (route->stream_handler) {
+          // A streamed route without a body, it ends right away.
+          BodyStream &body = c->the_parser.body_stream;
+          route->stream_handler(req, res, body);
+          if (body.on_end) body.on_end();
           return;
         }
+        route->handler(req, res);
+        return;
+      }
+      if (limit) limit->count.fetch_sub(1, std::memory_order_relaxed);
+      if (other_method && req.method == Method::OPTIONS) {
+        // CORS preflight, the CORS headers are in every response.
+        Response res { c->create_response(&c->server->unknown_prefix, c->server->unknown_latency) };
+        res.send();
+        return;
+      }
+      if (other_method) {
+        Response res { c->create_response(&c->server->unknown_prefix, c->server->unknown_latency) };
+        res.body() << "Method not allowed for " << req.url;
+        res.send(Response::Code::METHOD_NOT_ALLOWED);
+        return;
       }
       // No handler for the request, send 404 error.
-      Response res { c->create_response("/unknown") };
+      Response res { c->create_response(&c->server->unknown_prefix, c->server->unknown_latency) };
       res.body() << "Request not found for " << req.url;
       res.send(Response::Code::NOT_FOUND);
 
@@ -288,170 +2118,1637 @@ static void on_connect(uv_stream_t* server_handle, int status) {
       // Log::info("Connection closing %p", c);
       c->cleanup();
     });
+
+  HttpParser &parser = c->the_parser;
+  parser.max_header_size = c->server->max_header_size;
+  parser.max_body_size = c->server->max_body_size;
+  parser.reject_cb = [c](int status) {
+    // Answers, then closes since the rest of the request is not read.
+    ServerImpl *server = c->server;
+    c->close_when_done = true;
+    Response res { c->create_response(&server->unknown_prefix, server->unknown_latency) };
+    if (status == 431) {
+      server->stats.rejected_header.inc();
+      res.body() << "Request header fields too large";
+      res.send(Response::Code::HEADER_FIELDS_TOO_LARGE);
+    } else if (status == 413) {
+      server->stats.rejected_body.inc();
+      res.body() << "Payload too large";
+      res.send(Response::Code::PAYLOAD_TOO_LARGE);
+    } else {
+      server->stats.rejected_malformed.inc();
+      res.body() << "Bad request";
+      res.send(Response::Code::BAD_REQUEST);
+    }
+  };
+  if (c->server->has_stream_routes) {
+    parser.headers_cb = [c](Request &req) {
+      bool other_method = false;
+      Route *route = c->server->router.match(req, &other_method);
+      if (!route || !route->stream_handler) return false;
+      InFlightLimit *limit;
+      if (!c->admit(req, &limit)) return true;   // The body is discarded.
+      ResponseImpl *impl = c->create_response(&route->pattern, route->latency);
+      if (limit) impl->in_flight = &limit->count;
+      impl->read_headers(req);
+      Response res { impl };
+      route->stream_handler(req, res, c->the_parser.body_stream);
+      return true;
+    };
+  }
 }
 
-void ServerImpl::listen(string address, int port) {
-  signal(SIGPIPE, SIG_IGN);
-  uv_tcp_t server;
-  server.data = this;
-  int status = uv_tcp_init(uv_default_loop(), &server);
+Worker::Worker(ServerImpl *s, int i): server(s), id(i), cpu(-1), loop(nullptr), maintenance_ticks(0) {
+  listener.data = this;
+  maintenance_timer.data = this;
+  posted_async.data = this;
+  header_buffers_capacity = connection_pool.capacity = response_pool.capacity = s->pool_capacity;
+}
+
+Worker::~Worker() {}
+
+// Binds this worker's listening socket. With several workers, each one gets its
+// own socket with SO_REUSEPORT so that the kernel spreads the connections.
+// When SO_REUSEPORT is not available, the workers share (a dup of) the socket
+// of the first worker and accept from it concurrently.
+void Worker::bind(const struct sockaddr_in &addr, int num_workers, Worker *first) {
+  int status = uv_tcp_init(loop, &listener);
   assert(!status);
-  struct sockaddr_in addr;
-  status = uv_ip4_addr(address.c_str(), port, &addr);
+  if (num_workers > 1) {
+    int fd = -1;
+#ifdef SO_REUSEPORT
+    int on = 1;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+      Log::warn("SO_REUSEPORT not supported, workers will share one socket");
+      ::close(fd);
+      fd = -1;
+    }
+#endif
+    if (fd < 0 && first != this) {
+      uv_os_fd_t shared;
+      status = uv_fileno((uv_handle_t*) &first->listener, &shared);
+      assert(!status);
+      fd = dup(shared);
+      assert(fd >= 0);
+      status = uv_tcp_open(&listener, fd);
+      assert(!status);
+      return;
+    }
+    if (fd >= 0) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      status = uv_tcp_open(&listener, fd);
+      assert(!status);
+    }
+  }
+  status = uv_tcp_bind(&listener, (const struct sockaddr*) &addr, 0);
   assert(!status);
-  status = uv_tcp_bind(&server, (const struct sockaddr*) &addr, 0);
+}
+
+static void pin_to_cpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    Log::warn("Failed pinning worker to CPU %d", cpu);
+  }
+#else
+  Log::warn("CPU pinning is not supported on this platform");
+#endif
+}
+
+void Worker::maintain() {
+  if (++maintenance_ticks % 10 == 0) {
+    connection_pool.trim();
+    response_pool.trim();
+    read_buffers().trim();
+    size_t keep = min(header_buffers.size(), header_buffers_capacity / 2);
+    server->stats.send_buffer_dealloc.inc(header_buffers.size() - keep);
+    header_buffers.resize(keep);
+  }
+  Varz &varz = server->varz;
+  connection_pool.export_to(varz, "server_pool_connection");
+  response_pool.export_to(varz, "server_pool_response");
+  read_buffers().export_to(varz, "server_pool_read_buffer");
+  varz.set("server_pool_header_buffer_free", header_buffers.size());
+  if (id == 0) {
+    varz.set("server_log_dropped", Log::dropped());
+    if (server->cache) server->cache->export_to(varz);
+    varz.set("server_connections", server->num_connections.load());
+    for (auto &l : server->in_flight_limits) varz.set("server_in_flight:" + l->prefix, l->count.load());
+    if (server->has_offload_routes) varz.set("server_offload_queued", server->handler_pool.queued());
+  }
+}
+
+static void on_maintenance_timer(uv_timer_t *timer) {
+  static_cast<Worker*>(timer->data)->maintain();
+}
+
+void Worker::post_send(ResponseImpl *res, Response::Code code) {
+  bool wake;
+  {
+    lock_guard<mutex> lock(posted_mu);
+    wake = posted.empty();    // Otherwise the loop is already woken up.
+    posted.push_back(make_pair(res, code));
+  }
+  if (wake) uv_async_send(&posted_async);
+}
+
+void Worker::send_posted() {
+  {
+    lock_guard<mutex> lock(posted_mu);
+    posted.swap(sending);
+  }
+  server->stats.posted_batch.inc();
+  server->stats.posted_send.inc(sending.size());
+  for (auto &p : sending) p.first->send(p.second);
+  sending.clear();
+}
+
+static void on_posted(uv_async_t *async) {
+  static_cast<Worker*>(async->data)->send_posted();
+}
+
+void Worker::run() {
+  current_worker = this;
+  read_buffers().capacity = server->pool_capacity;
+  if (cpu >= 0) pin_to_cpu(cpu);
+  if (server->io_engine != IoEngine::IO_URING || !listen_uring()) {
+    int status = uv_listen((uv_stream_t*) &listener, server->backlog, on_connect);
+    assert(!status);
+  }
+  uv_timer_init(loop, &maintenance_timer);
+  uv_timer_start(&maintenance_timer, on_maintenance_timer, 1000, 1000);
+  uv_async_init(loop, &posted_async, on_posted);
+  uv_run(loop, UV_RUN_DEFAULT);
+  current_worker = nullptr;
+}
+
+static void run_worker(void *arg) {
+  static_cast<Worker*>(arg)->run();
+}
+
+void ServerImpl::listen(string address, int port, int num_workers, bool pin_cpus) {
+  assert(num_workers >= 1 && workers.empty());
+  signal(SIGPIPE, SIG_IGN);
+  struct sockaddr_in addr;
+  int status = uv_ip4_addr(address.c_str(), port, &addr);
   assert(!status);
-  uv_listen((uv_stream_t*)&server, 128, on_connect);
-  Log::info("Listening on port %d", port);
+  int num_cpus = max(1, (int) std::thread::hardware_concurrency());
+  for (int i = 0; i < num_workers; i++) {
+    Worker *w = new Worker(this, i);
+    workers.push_back(unique_ptr<Worker>(w));
+    if (i == 0) {
+      w->loop = uv_default_loop();
+    } else {
+      w->loop = &w->own_loop;
+      status = uv_loop_init(w->loop);
+      assert(!status);
+    }
+    if (pin_cpus) w->cpu = i % num_cpus;
+    w->bind(addr, num_workers, workers[0].get());
+  }
+  if (num_workers == 1) {
+    Log::info("Listening on port %d", port);
+  } else {
+    Log::info("Listening on port %d with %d workers", port, num_workers);
+  }
   varz.set("server_start_time", time(NULL));
-  uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+  varz.set("server_workers", num_workers);
+  if (has_offload_routes) {
+    handler_pool.start(offload_threads ? offload_threads : num_cpus, offload_max_queued);
+  }
+  for (int i = 1; i < num_workers; i++) {
+    status = uv_thread_create(&workers[i]->thread, run_worker, workers[i].get());
+    assert(!status);
+  }
+  workers[0]->run();
+  for (int i = 1; i < num_workers; i++) uv_thread_join(&workers[i]->thread);
+}
+
+
+/***** io_uring engine *****/
+
+bool Worker::listen_uring() {
+#ifdef SIMPLE_HTTP_IO_URING
+  ring.reset(IoRing::create(this));
+  if (!ring) return false;
+  uv_os_fd_t fd;
+  int status = uv_fileno((uv_handle_t*) &listener, &fd);
+  assert(!status);
+  if (::listen(fd, server->backlog)) {
+    Log::severe("Failed listening: %s", strerror(errno));
+    abort();
+  }
+  ring->accept(fd);
+  server->varz.inc("server_io_uring_workers");
+  return true;
+#else
+  if (id == 0) Log::warn("Built without SIMPLE_HTTP_IO_URING, using libuv");
+  return false;
+#endif
+}
+
+#ifdef SIMPLE_HTTP_IO_URING
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, nullptr, 0);
 }
 
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void on_ring_event(uv_poll_t *handle, int status, int events) {
+  static_cast<IoRing*>(handle->data)->on_event();
+}
+
+// Before the loop waits: closes the sockets that were closed during the
+// iteration and submits what it prepared, in one system call.
+static void on_ring_prepare(uv_prepare_t *handle) {
+  IoRing *ring = static_cast<IoRing*>(handle->data);
+  ring->close_sockets();
+  ring->submit();
+}
+
+IoRing::IoRing(Worker *worker):
+    multishot_recv(true), worker(worker), ring_fd(-1), event_fd(-1), listen_fd(-1),
+    ring_mem(MAP_FAILED), ring_size(0), sqes((struct io_uring_sqe*) MAP_FAILED), sqes_size(0),
+    buf_ring((struct io_uring_buf*) MAP_FAILED), buf_tail(0), buffers((char*) MAP_FAILED) {
+  accept_op.type = UringOp::ACCEPT;
+  accept_op.socket = nullptr;
+  submits = worker->server->varz.counter("server_io_uring_submit");
+  completions = worker->server->varz.counter("server_io_uring_completion");
+}
+
+IoRing::~IoRing() {
+  if (buffers != MAP_FAILED) munmap(buffers, (size_t) NUM_BUFFERS * BUFFER_SIZE);
+  if (buf_ring != MAP_FAILED) munmap(buf_ring, NUM_BUFFERS * sizeof(struct io_uring_buf));
+  if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+  if (ring_mem != MAP_FAILED) munmap(ring_mem, ring_size);
+  if (event_fd >= 0) ::close(event_fd);
+  if (ring_fd >= 0) ::close(ring_fd);
+}
+
+IoRing* IoRing::create(Worker *worker) {
+  unique_ptr<IoRing> ring(new IoRing(worker));
+  return ring->init() ? ring.release() : nullptr;
+}
+
+bool IoRing::init() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = CQ_ENTRIES;
+  ring_fd = io_uring_setup(SQ_ENTRIES, &p);
+  if (ring_fd < 0) {
+    Log::warn("io_uring is not available (%s), using libuv", strerror(errno));
+    return false;
+  }
+  const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+  if ((p.features & required) != required) {
+    Log::warn("io_uring is too old, using libuv");
+    return false;
+  }
+
+  // The submission and completion rings share one mapping.
+  ring_size = max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                  p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+  ring_mem = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe*) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ring_fd, IORING_OFF_SQES);
+  if (ring_mem == MAP_FAILED || sqes == MAP_FAILED) {
+    Log::warn("Failed mapping the io_uring rings (%s), using libuv", strerror(errno));
+    return false;
+  }
+  char *m = static_cast<char*>(ring_mem);
+  sq_head = (unsigned*) (m + p.sq_off.head);
+  sq_tail = (unsigned*) (m + p.sq_off.tail);
+  sq_mask = *(unsigned*) (m + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  unsigned *array = (unsigned*) (m + p.sq_off.array);
+  for (unsigned i = 0; i < sq_entries; i++) array[i] = i;
+  tail = submitted = *sq_tail;
+  cq_head = (unsigned*) (m + p.cq_off.head);
+  cq_tail = (unsigned*) (m + p.cq_off.tail);
+  cq_mask = *(unsigned*) (m + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*) (m + p.cq_off.cqes);
+
+  // The recvs pick their buffer from a ring of provided buffers.
+  buf_ring = (struct io_uring_buf*) mmap(nullptr, NUM_BUFFERS * sizeof(struct io_uring_buf),
+                                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  buffers = (char*) mmap(nullptr, (size_t) NUM_BUFFERS * BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED || buffers == MAP_FAILED) {
+    Log::warn("Failed allocating the io_uring buffers, using libuv");
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) buf_ring;
+  reg.ring_entries = NUM_BUFFERS;
+  reg.bgid = BUFFER_GROUP;
+  if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    Log::warn("io_uring provided buffer rings need Linux 5.19 (%s), using libuv", strerror(errno));
+    return false;
+  }
+  for (unsigned i = 0; i < NUM_BUFFERS; i++) recycle_buffer(i);
+
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0 || io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1)) {
+    Log::warn("Failed registering the io_uring eventfd (%s), using libuv", strerror(errno));
+    return false;
+  }
+  uv_poll_init(worker->loop, &poll, event_fd);
+  poll.data = this;
+  uv_poll_start(&poll, UV_READABLE, on_ring_event);
+  uv_prepare_init(worker->loop, &prepare);
+  prepare.data = this;
+  uv_prepare_start(&prepare, on_ring_prepare);
+  return true;
+}
+
+void IoRing::on_event() {
+  uint64_t n;
+  while (read(event_fd, &n, sizeof(n)) > 0) {}
+  reap();
+}
+
+void IoRing::accept(int fd) {
+  listen_fd = fd;
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = (uint64_t) &accept_op;
+}
+
+void IoRing::on_accept(int res, unsigned flags) {
+  if (!(flags & IORING_CQE_F_MORE)) accept(listen_fd);
+  if (res < 0) {
+    static Log::RateLimit failed_accepts(1000);
+    failed_accepts.warn("Failed accepting a connection: %s", strerror(-res));
+    return;
+  }
+  on_uring_connect(worker, res);
+}
+
+struct io_uring_sqe* IoRing::get_sqe() {
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+    submit();
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+      Log::severe("The io_uring submission queue is full");
+      abort();
+    }
+  }
+  struct io_uring_sqe *sqe = &sqes[tail & sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  tail++;
+  return sqe;
+}
+
+void IoRing::submit() {
+  if (submitted == tail) return;
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+  while (submitted != tail) {
+    int n = io_uring_enter(ring_fd, tail - submitted);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EBUSY)) return;   // Retried on the next iteration.
+    if (n < 0) {
+      Log::severe("io_uring_enter failed: %s", strerror(errno));
+      abort();
+    }
+    submitted += n;
+    submits.inc();
+  }
+}
+
+void IoRing::reap() {
+  while (true) {
+    // The head is read again since the callbacks may reap too.
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) break;
+    struct io_uring_cqe cqe = cqes[head & cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    completions.inc();
+    UringOp *op = (UringOp*) cqe.user_data;
+    if (!op) continue;    // A cancellation.
+    if (op->type == UringOp::ACCEPT) {
+      on_accept(cqe.res, cqe.flags);
+    } else {
+      op->socket->on_complete(op, cqe.res, cqe.flags);
+    }
+  }
+}
+
+void IoRing::recycle_buffer(unsigned id) {
+  // The ring tail overlays the reserved field of the first entry.
+  struct io_uring_buf *b = &buf_ring[buf_tail & (NUM_BUFFERS - 1)];
+  b->addr = (uint64_t) buffer(id);
+  b->len = BUFFER_SIZE;
+  b->bid = id;
+  buf_tail++;
+  __atomic_store_n(&((struct io_uring_buf_ring*) buf_ring)->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+void IoRing::close_sockets() {
+  while (!closed_sockets.empty()) {
+    UringSocket *s = closed_sockets.back();
+    closed_sockets.pop_back();
+    s->finish_close();
+  }
+}
+
+UringSocket::UringSocket():
+    ring(nullptr), fd(-1), parser(nullptr), reading(false), recv_armed(false), sending(false),
+    closing_(false), close_queued(false), in_flight(0) {
+  recv_op.type = UringOp::RECV;
+  recv_op.socket = this;
+  send_op.type = UringOp::SEND;
+  send_op.socket = this;
+  memset(&msg, 0, sizeof(msg));
+}
+
+void UringSocket::open(IoRing *ring, int fd, HttpParser *parser) {
+  this->ring = ring;
+  this->fd = fd;
+  this->parser = parser;
+}
+
+void UringSocket::arm_recv() {
+  struct io_uring_sqe *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = IoRing::BUFFER_GROUP;
+  if (ring->multishot_recv) sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = (uint64_t) &recv_op;
+  recv_armed = true;
+  in_flight++;
+}
+
+void UringSocket::cancel(UringOp *op) {
+  struct io_uring_sqe *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uint64_t) op;
+  sqe->user_data = 0;   // Its completion is ignored.
+}
+
+void UringSocket::read_start() {
+  assert(!closing_);
+  reading = true;
+  if (!recv_armed) arm_recv();
+}
+
+void UringSocket::read_stop() {
+  // What arrives until the recv is cancelled is dropped, or held while paused.
+  reading = false;
+  if (recv_armed) cancel(&recv_op);
+}
+
+void UringSocket::on_recv(int res, unsigned flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    recv_armed = false;
+    in_flight--;
+  }
+  if (res > 0) {
+    unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+    const char *data = ring->buffer(id);
+    if (closing_) {
+      // Dropped.
+    } else if (parser->paused) {
+      parser->held.append(data, res);
+    } else if (reading && !parser->parse(data, res)) {
+      assert(parser->state != HttpParserState::CLOSED);
+      parser->fail();
+    }
+    ring->recycle_buffer(id);   // The parser copied what it keeps.
+  } else if (res == -EINVAL && ring->multishot_recv) {
+    Log::warn("io_uring multishot recv needs Linux 6.0, using single recvs");
+    ring->multishot_recv = false;
+  } else if (res != -ENOBUFS && res != -ECANCELED && !closing_) {
+    parser->close();    // The client closed the connection, or an error.
+  }
+  if (reading && !recv_armed && !closing_) arm_recv();
+}
+
+int UringSocket::write(uv_write_t *req, const uv_buf_t bufs[], unsigned nbufs, uv_write_cb cb) {
+  writes.emplace_back();
+  Write &w = writes.back();
+  w.req = req;
+  w.cb = cb;
+  w.next = 0;
+  w.iov.resize(nbufs);
+  for (unsigned i = 0; i < nbufs; i++) {
+    w.iov[i].iov_base = bufs[i].base;
+    w.iov[i].iov_len = bufs[i].len;
+  }
+  if (!sending && !closing_) send_next();
+  return 0;
+}
+
+void UringSocket::send_next() {
+  Write &w = writes.front();
+  msg.msg_iov = &w.iov[w.next];
+  msg.msg_iovlen = min(w.iov.size() - w.next, (size_t) IOV_MAX);
+  struct io_uring_sqe *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) &msg;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t) &send_op;
+  sending = true;
+  in_flight++;
+}
+
+void UringSocket::on_send(int res) {
+  sending = false;
+  in_flight--;
+  if (closing_) return;   // The writes are cancelled by finish_close().
+  Write &w = writes.front();
+  if (res >= 0) {
+    // Skips what was sent, a short send continues with the rest.
+    size_t n = res;
+    while (w.next < w.iov.size() && n >= w.iov[w.next].iov_len) n -= w.iov[w.next++].iov_len;
+    if (n) {
+      w.iov[w.next].iov_base = (char*) w.iov[w.next].iov_base + n;
+      w.iov[w.next].iov_len -= n;
+    }
+    if (w.next < w.iov.size()) return send_next();
+  }
+  uv_write_t *req = w.req;
+  uv_write_cb cb = w.cb;
+  writes.pop_front();
+  cb(req, res < 0 ? res : 0);
+  if (!sending && !closing_ && !writes.empty()) send_next();
+}
+
+void UringSocket::close() {
+  assert(!closing_);
+  closing_ = true;
+  reading = false;
+  // Completes the recv and the sendmsg in flight.
+  ::shutdown(fd, SHUT_RDWR);
+  if (recv_armed) cancel(&recv_op);
+  if (sending) cancel(&send_op);
+  maybe_closed();
+}
+
+void UringSocket::on_complete(UringOp *op, int res, unsigned flags) {
+  if (op == &recv_op) {
+    on_recv(res, flags);
+  } else {
+    on_send(res);
+  }
+  maybe_closed();
+}
+
+void UringSocket::maybe_closed() {
+  if (closing_ && !in_flight && !close_queued) {
+    close_queued = true;
+    ring->closed(this);
+  }
+}
+
+void UringSocket::finish_close() {
+  // As libuv, the writes not done fail before the close callback.
+  while (!writes.empty()) {
+    Write w = std::move(writes.front());
+    writes.pop_front();
+    w.cb(w.req, UV_ECANCELED);
+  }
+  ::close(fd);
+  fd = -1;
+  parser->closed();   // May destroy this socket.
+}
+
+#endif
+
 
 
 #define CRLF "\r\n"
+#define DEFAULT_CONTENT_TYPE "application/json; charset=utf-8"
 #define CORS_HEADERS                                       \
-  "Content-Type: application/json; charset=utf-8"     CRLF \
   "Access-Control-Allow-Origin: *"                    CRLF \
   "Access-Control-Allow-Methods: GET, POST, OPTIONS"  CRLF \
   "Access-Control-Allow-Headers: X-Requested-With"    CRLF
 
+// The status line and the static headers of each response code.
+struct StatusHeaders {
+  const char *str;
+  size_t len;
+};
+
+#define STATUS_HEADERS(status_line) { status_line CRLF CORS_HEADERS, sizeof(status_line CRLF CORS_HEADERS) - 1 }
+
+static const StatusHeaders& status_headers(Response::Code code) {
+  static const StatusHeaders ok = STATUS_HEADERS("HTTP/1.1 200 OK");
+  static const StatusHeaders not_found = STATUS_HEADERS("HTTP/1.1 404 Not Found");
+  static const StatusHeaders not_allowed = STATUS_HEADERS("HTTP/1.1 405 Method Not Allowed");
+  static const StatusHeaders not_modified = STATUS_HEADERS("HTTP/1.1 304 Not Modified");
+  static const StatusHeaders partial = STATUS_HEADERS("HTTP/1.1 206 Partial Content");
+  static const StatusHeaders not_satisfiable = STATUS_HEADERS("HTTP/1.1 416 Range Not Satisfiable");
+  // The rest of a rejected request is not read, so the connection is closed.
+  static const StatusHeaders too_large = STATUS_HEADERS("HTTP/1.1 413 Payload Too Large" CRLF "Connection: close");
+  static const StatusHeaders headers_too_large =
+    STATUS_HEADERS("HTTP/1.1 431 Request Header Fields Too Large" CRLF "Connection: close");
+  static const StatusHeaders bad_request = STATUS_HEADERS("HTTP/1.1 400 Bad Request" CRLF "Connection: close");
+  static const StatusHeaders unavailable = STATUS_HEADERS("HTTP/1.1 503 Service Unavailable");
+  static const StatusHeaders error = STATUS_HEADERS("HTTP/1.1 500 Internal Server Error");
+  switch (code) {
+    case Response::Code::OK: return ok;
+    case Response::Code::NOT_FOUND: return not_found;
+    case Response::Code::METHOD_NOT_ALLOWED: return not_allowed;
+    case Response::Code::NOT_MODIFIED: return not_modified;
+    case Response::Code::PARTIAL_CONTENT: return partial;
+    case Response::Code::RANGE_NOT_SATISFIABLE: return not_satisfiable;
+    case Response::Code::PAYLOAD_TOO_LARGE: return too_large;
+    case Response::Code::HEADER_FIELDS_TOO_LARGE: return headers_too_large;
+    case Response::Code::SERVICE_UNAVAILABLE: return unavailable;
+    case Response::Code::SERVER_ERROR: return error;
+    case Response::Code::BAD_REQUEST: return bad_request;
+    default: Log::severe("unknown code %d", code); assert(0); return error;
+  }
+}
+
+#undef STATUS_HEADERS
+
+static void append_uint(string &s, unsigned long long v) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  do { *--p = '0' + v % 10; v /= 10; } while (v);
+  s.append(p, buf + sizeof(buf) - p);
+}
+
 static void after_flush(uv_write_t* req, int status) {
   ResponseImpl* res = static_cast<ResponseImpl*>(req->data);
   assert(res);
   res->finish();
 }
 
-ResponseImpl::ResponseImpl(Connection *con, string req_url):
+void Worker::take_header_buffer(string &buf) {
+  if (header_buffers.empty()) {
+    server->stats.send_buffer_alloc.inc();
+    buf.reserve(512);
+  } else {
+    buf.swap(header_buffers.back());
+    header_buffers.pop_back();
+  }
+  buf.clear();
+}
+
+void Worker::recycle_header_buffer(string &buf) {
+  if (header_buffers.size() < header_buffers_capacity) {
+    header_buffers.push_back(string());
+    header_buffers.back().swap(buf);
+  } else {
+    server->stats.send_buffer_dealloc.inc();
+  }
+}
+
+ResponseImpl::ResponseImpl(Connection *con, const string *prefix, Histogram latency):
+  body(&body_buffer),
   max_age_s(0),
   max_runtime_ms(500),
   last_modified(0),
+  if_modified_since(0),
+  body_skipped(false),
+  head(false),
+  accept_encoding(0),
+  encoding(0),
+  vary(false),
+  file_offset(0),
+  file_length(0),
+  streaming(false),
+  header_sent(false),
+  stream_writing(false),
+  stream_failed(false),
+  ready(false),
+  in_flight(nullptr),
   c(con),
-  url(req_url),
+  prefix(prefix),
+  latency(latency),
   start_time(high_resolution_clock::now()),
-  send_buffer({nullptr, 0}),
-  state(0) {}
+  state(0),
+  code(Response::Code::OK) {}
+
+// Whether the content type is worth compressing (text, JSON, XML, SVG, ...).
+static bool compressible(const string &content_type) {
+  if (content_type.empty()) return true;    // The default JSON.
+  if (!content_type.compare(0, 5, "text/")) return true;
+  for (const char *s : { "json", "javascript", "xml", "svg" }) {
+    if (content_type.find(s) != string::npos) return true;
+  }
+  return false;
+}
 
-ResponseImpl::~ResponseImpl() {
-  if (send_buffer.base) {
-    c->server->varz.inc("server_send_buffer_dealloc");
-    delete[] send_buffer.base;
+// Compresses n bytes into out with the encoding at the zlib level. The zlib
+// streams are reused, one per thread (loops and thread pool) and encoding.
+static bool deflate_to(int encoding, int level, const char *p, size_t n, string &out) {
+  struct Deflater {
+    Deflater(): level(-1) {}
+    ~Deflater() { if (level >= 0) deflateEnd(&zs); }
+    z_stream zs;
+    int level;    // -1 when zs is not initialized.
+  };
+  static thread_local Deflater deflaters[2];
+  if (n > UINT_MAX) return false;
+  Deflater &d = deflaters[encoding == ENCODING_GZIP ? 0 : 1];
+  if (d.level >= 0 && d.level != level) {
+    deflateEnd(&d.zs);
+    d.level = -1;
+  }
+  if (d.level < 0) {
+    memset(&d.zs, 0, sizeof(d.zs));
+    int window_bits = encoding == ENCODING_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&d.zs, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    d.level = level;
+  } else {
+    deflateReset(&d.zs);
+  }
+  out.resize(deflateBound(&d.zs, n));
+  d.zs.next_in = (Bytef*) p;
+  d.zs.avail_in = n;
+  d.zs.next_out = (Bytef*) &out[0];
+  d.zs.avail_out = out.size();
+  if (deflate(&d.zs, Z_FINISH) != Z_STREAM_END) return false;
+  out.resize(d.zs.total_out);
+  return true;
+}
+
+// Parses an HTTP date in the preferred format, e.g. "Sun, 11 May 2014 10:27:13 GMT".
+// Returns 0 if it is not valid.
+static time_t parse_http_date(StringView s) {
+  char buf[64];
+  if (s.size() >= sizeof(buf)) return 0;
+  memcpy(buf, s.data(), s.size());
+  buf[s.size()] = 0;
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end) return 0;
+  return timegm(&tm);
+}
+
+// Returns the entity tag without its weakness indicator.
+static StringView opaque_tag(StringView tag) {
+  if (tag.size() >= 2 && tag[0] == 'W' && tag[1] == '/') return StringView(tag.data() + 2, tag.size() - 2);
+  return tag;
+}
+
+// Whether etag is in the If-None-Match list, with the weak comparison.
+static bool etag_matches(const string &list, const string &etag) {
+  StringView tag = opaque_tag(etag);
+  size_t i = 0;
+  while (i < list.size()) {
+    size_t j = list.find(',', i);
+    if (j == string::npos) j = list.size();
+    size_t b = i, e = j;
+    while (b < e && isspace((unsigned char) list[b])) b++;
+    while (e > b && isspace((unsigned char) list[e - 1])) e--;
+    StringView candidate(list.data() + b, e - b);
+    if (candidate == "*" || opaque_tag(candidate) == tag) return true;
+    i = j + 1;
   }
+  return false;
+}
+
+// Returns the mask of the encodings in an Accept-Encoding header.
+static int parse_accept_encoding(StringView s) {
+  int mask = 0;
+  size_t i = 0;
+  while (i < s.size()) {
+    size_t j = i;
+    while (j < s.size() && s[j] != ',') j++;
+    size_t b = i, e = j;
+    while (b < e && isspace((unsigned char) s[b])) b++;
+    size_t name_end = b;
+    while (name_end < e && s[name_end] != ';' && !isspace((unsigned char) s[name_end])) name_end++;
+    StringView name(s.data() + b, name_end - b);
+
+    // Skips the encodings with q=0, e.g. "gzip;q=0".
+    bool rejected = false;
+    for (size_t k = name_end; k + 2 < e; k++) {
+      if (s[k] == 'q' && s[k + 1] == '=') {
+        rejected = strtod(string(s.data() + k + 2, e - k - 2).c_str(), nullptr) <= 0;
+        break;
+      }
+    }
+    if (!rejected) {
+      if (name.equals_ignore_case(StringView("gzip", 4)) || name.equals_ignore_case(StringView("x-gzip", 6))) {
+        mask |= ENCODING_GZIP;
+      } else if (name.equals_ignore_case(StringView("deflate", 7))) {
+        mask |= ENCODING_DEFLATE;
+      } else if (name == "*") {
+        mask |= ENCODING_GZIP | ENCODING_DEFLATE;
+      }
+    }
+    i = j + 1;
+  }
+  return mask;
+}
+
+void ResponseImpl::read_headers(Request &req) {
+  head = req.method == Method::HEAD;
+  if (req.method == Method::GET || head) {
+    StringView v = req.header("Range");
+    if (!v.empty()) {
+      range.assign(v.data(), v.size());
+      v = req.header("If-Range");
+      if_range.assign(v.data(), v.size());
+    }
+    v = req.header("If-None-Match");
+    if (!v.empty()) if_none_match.assign(v.data(), v.size());
+    v = req.header("If-Modified-Since");
+    if (!v.empty()) if_modified_since = parse_http_date(v);
+    if (!if_none_match.empty() || if_modified_since) c->server->stats.revalidation.inc();
+  }
+  if (c->server->compression) accept_encoding = parse_accept_encoding(req.header("Accept-Encoding"));
+}
+
+bool ResponseImpl::validators_match(const string &etag, time_t last_modified) {
+  // If-None-Match takes precedence over If-Modified-Since.
+  if (!if_none_match.empty()) return !etag.empty() && etag_matches(if_none_match, etag);
+  return if_modified_since > 0 && last_modified > 0 && last_modified <= if_modified_since;
+}
+
+ResponseImpl::~ResponseImpl() {
+  if (in_flight) in_flight->fetch_sub(1, std::memory_order_relaxed);
+  if (header.capacity()) c->worker->recycle_header_buffer(header);
+}
+
+bool ResponseImpl::on_loop() {
+  return current_worker == c->worker;
 }
 
 void ResponseImpl::send(Response::Code code) {
   assert(c);          // send() can only be called exactly once.
+  if (!on_loop()) return c->worker->post_send(this, code);
   this->state = 1;    // after send().
   this->code = code;
   // Log::info("RESPONSE send con = %p, code = %d", c, code);
   c->cleanup();
 }
 
-void ResponseImpl::flush(uv_write_cb cb) {
-  assert(state == 1);
-  state = 2; // after flush().
-  assert(c);
-  assert(c->the_parser.state != HttpParserState::CLOSED);
-  assert(!c->disposeable());
-  c->server->varz.inc("server_response_send");
+// Parses a single range "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+// of a file of the size. Returns false if the range is not satisfiable. The
+// whole file is sent for other ranges, e.g. multiple ones.
+static bool parse_range(const string &range, size_t size, size_t &offset, size_t &length) {
+  offset = 0;
+  length = size;
+  if (range.compare(0, 6, "bytes=") || range.find(',') != string::npos) return true;
+  const char *p = range.c_str() + 6;
+  char *end;
+  if (*p == '-') {
+    unsigned long long suffix = strtoull(p + 1, &end, 10);
+    if (end == p + 1 || *end) return true;
+    if (!suffix || !size) return false;
+    length = min((size_t) suffix, size);
+    offset = size - length;
+    return true;
+  }
+  unsigned long long first = strtoull(p, &end, 10);
+  if (end == p || *end != '-') return true;
+  p = end + 1;
+  unsigned long long last = size ? size - 1 : 0;
+  if (*p) {
+    last = strtoull(p, &end, 10);
+    if (*end || last < first) return true;
+  }
+  if (first >= size) return false;
+  offset = first;
+  length = min((size_t) last, size - 1) - first + 1;
+  return true;
+}
+
+void ResponseImpl::send_file(const string &path) {
+  file = c->server->files.open(path);
+  if (!file) {
+    body << "File not found " << path;
+    return send(Response::Code::NOT_FOUND);
+  }
+  content_type = file->content_type;
+  last_modified = file->mtime;
+  etag = file->etag;
+  Response::Code code = Response::Code::OK;
+  if (!range.empty() && (if_range.empty() || if_range == etag)) {
+    if (!parse_range(range, file->size, file_offset, file_length)) {
+      code = Response::Code::RANGE_NOT_SATISFIABLE;
+    } else if (file_length != file->size) {
+      code = Response::Code::PARTIAL_CONTENT;
+    }
+  } else {
+    file_offset = 0;
+    file_length = file->size;
+  }
+  send(code);
+}
+
+void ResponseImpl::append_head(string &h, size_t body_size, int encoding) {
+  const StatusHeaders &status = status_headers(code);
+  h.append(status.str, status.len);
+  if (code != Response::Code::NOT_MODIFIED) {
+    h.append("Content-Type: ");
+    if (content_type.empty()) h.append(DEFAULT_CONTENT_TYPE); else h.append(content_type);
+    if (streaming) {
+      h.append(CRLF "Transfer-Encoding: chunked" CRLF);
+    } else {
+      h.append(CRLF "Content-Length: ");
+      append_uint(h, body_size);
+      h.append(CRLF);
+    }
+    if (encoding) h.append(encoding == ENCODING_GZIP ? "Content-Encoding: gzip" CRLF : "Content-Encoding: deflate" CRLF);
+  }
+  if (file) {
+    h.append("Accept-Ranges: bytes" CRLF);
+    if (code == Response::Code::PARTIAL_CONTENT) {
+      h.append("Content-Range: bytes ");
+      append_uint(h, file_offset);
+      h.push_back('-');
+      append_uint(h, file_offset + file_length - 1);
+      h.push_back('/');
+      append_uint(h, file->size);
+      h.append(CRLF);
+    } else if (code == Response::Code::RANGE_NOT_SATISFIABLE) {
+      h.append("Content-Range: bytes */");
+      append_uint(h, file->size);
+      h.append(CRLF);
+    }
+  }
+  if (code == Response::Code::SERVICE_UNAVAILABLE) {
+    h.append("Retry-After: ");
+    append_uint(h, c->server->retry_after_s);
+    h.append(CRLF);
+    if (c->close_when_done) h.append("Connection: close" CRLF);
+  }
+  if (vary) h.append("Vary: Accept-Encoding" CRLF);
+  if (max_age_s > 0) {
+    h.append("Cache-Control: public,max-age=");
+    append_uint(h, max_age_s);
+    h.append(CRLF);
+  }
+  if (last_modified > 0) {
+    h.append("Last-Modified: ");
+    c->worker->last_modified.append_to(h, last_modified);
+    h.append(CRLF);
+  }
+  if (!etag.empty()) {
+    h.append("ETag: ");
+    h.append(etag);
+    h.append(CRLF);
+  }
+}
+
+void ResponseImpl::compress() {
+  ServerImpl *server = c->server;
+  if (!deflate_to(encoding, server->compression_level, body_buffer.data(), body_buffer.size(), encoded) ||
+      encoded.size() >= body_buffer.size()) {
+    encoding = 0;
+    encoded.clear();
+  }
+}
+
+static void compress_work(uv_work_t *req) {
+  static_cast<ResponseImpl*>(req->data)->compress();
+}
+
+static void after_compress_work(uv_work_t *req, int status) {
+  ResponseImpl *res = static_cast<ResponseImpl*>(req->data);
+  if (res->connection()->the_parser.state == HttpParserState::CLOSED) return res->finish();
+  res->write_response();
+  res->connection()->flush_responses();
+}
+
+void ResponseImpl::flush(uv_write_cb cb) {
+  assert(state == 1);
+  state = 2; // after flush().
+  assert(c);
+  assert(c->the_parser.state != HttpParserState::CLOSED);
+  assert(!c->disposeable());
+  ServerImpl *server = c->server;
+  server->stats.response_send.inc();
+  write_cb = cb;
+
+  if (streaming) {
+    if (stream_failed || c->closing()) return finish();
+    // The last chunk follows the write in progress, if any.
+    if (!stream_writing) end_stream();
+    return;
+  }
+
+  if (cached) {
+    if (!validators_match(cached->etag, cached->last_modified)) {
+      // A cache hit, in the accepted encoding if it was stored.
+      time_t now = time(NULL);
+      bool encoded = cached->encoding && (accept_encoding & cached->encoding);
+      c->worker->take_header_buffer(header);
+      header.append(encoded ? cached->encoded_head : cached->head);
+      header.append("Age: ");
+      append_uint(header, max(now - cached->stored, (time_t) 0));
+      header.append(CRLF);
+      const string &body = encoded ? cached->encoded_body : cached->body;
+      return write(body.data(), body.size());
+    }
+    // Revalidation of a cached response, with its remaining lifetime.
+    etag = cached->etag;
+    last_modified = cached->last_modified;
+    max_age_s = max(cached->expires - time(NULL), (time_t) 1);
+    code = Response::Code::NOT_MODIFIED;
+    cached.reset();
+    return write_response();
+  }
+
+  size_t size = body_buffer.size();
+  if (server->compression && code == Response::Code::OK && !body_skipped && !file &&
+      size >= server->compression_min_size && compressible(content_type)) {
+    vary = true;
+    bool not_modified = validators_match(etag, last_modified);
+    bool cacheable = !cache_key.empty() && max_age_s > 0;
+    if (accept_encoding && (!not_modified || cacheable)) {
+      encoding = (accept_encoding & ENCODING_GZIP) ? ENCODING_GZIP : ENCODING_DEFLATE;
+      server->stats.compression_in_bytes.inc(size);
+      if (server->compression_offload_size && size >= server->compression_offload_size) {
+        server->stats.compression_offloaded.inc();
+        work_req.data = this;
+        int error = uv_queue_work(c->worker->loop, &work_req, compress_work, after_compress_work);
+        assert(!error);
+        return;
+      }
+      compress();
+    }
+  }
+  write_response();
+}
+
+void ResponseImpl::write_response() {
+  ServerImpl *server = c->server;
+  if (encoding) server->stats.compression_out_bytes.inc(encoded.size());
+  const char *body_data = body_buffer.data();
+  size_t body_size = body_buffer.size();
+  if (encoding) {
+    body_data = encoded.data();
+    body_size = encoded.size();
+  }
+  if (file && code != Response::Code::RANGE_NOT_SATISFIABLE) {
+    body_data = file->data + file_offset;
+    body_size = file_length;
+  }
+  if (code == Response::Code::OK || (file && code == Response::Code::PARTIAL_CONTENT)) {
+    if (!cache_key.empty() && max_age_s > 0 && !body_skipped && !file) {
+      // Everything but the Date header can be sent again from the cache,
+      // the bodies are moved there and sent from there.
+      shared_ptr<CachedResponse> res = std::make_shared<CachedResponse>();
+      append_head(res->head, body_buffer.size(), 0);
+      body_buffer.take(res->body);
+      res->encoding = encoding;
+      if (encoding) {
+        append_head(res->encoded_head, encoded.size(), encoding);
+        res->encoded_body.swap(encoded);
+      }
+      res->stored = time(NULL);
+      res->expires = res->stored + max_age_s;
+      res->etag = etag;
+      res->last_modified = last_modified;
+      body_data = encoding ? res->encoded_body.data() : res->body.data();
+      cached = res;
+      server->cache->store(cache_key, std::move(res));
+    }
+    if (body_skipped || validators_match(etag, last_modified)) code = Response::Code::NOT_MODIFIED;
+  }
+  if (code == Response::Code::NOT_MODIFIED) {
+    server->stats.not_modified.inc();
+    body_size = 0;
+  }
+  c->worker->take_header_buffer(header);
+  append_head(header, body_size, encoding);
+  write(body_data, head ? 0 : body_size);
+}
+
+void ResponseImpl::write(const char *body_data, size_t body_size) {
+  ServerVarz &stats = c->server->stats;
+  header.append("Date: ");
+  c->worker->date.append_to(header, time(NULL));
+  header.append(CRLF CRLF);
+
+  out_data = body_data;
+  out_size = body_size;
+  stats.sent_bytes.inc(header.size() + body_size);
+
+  auto dur = duration_cast<microseconds>(high_resolution_clock::now() - start_time).count();
+  stats.response.add(dur);
+  latency.add(dur);
+  if (dur * 1e-3 >= max_runtime_ms) {
+    static Log::RateLimit slow_responses(1000);
+    slow_responses.warn("runtime = %6.3lf, prefix = %s", dur * 1e-6, prefix->c_str());
+  }
+  ready = true;
+}
+
+void ResponseImpl::append_bufs(vector<uv_buf_t> &bufs) {
+  assert(ready);
+  ready = false;
+  // The header and the body are written without copying the body.
+  bufs.push_back(uv_buf_init(&header[0], header.size()));
+  if (out_size) bufs.push_back(uv_buf_init((char*) out_data, out_size));
+}
+
+
+
+// The data waiting to be written above which write_chunk() returns false.
+constexpr size_t STREAM_HIGH_WATER = 1 << 20;
+
+// Appends data as one chunk of the chunked transfer encoding.
+static void append_chunk(string &s, const char *data, size_t size) {
+  if (!size) return;    // An empty chunk would end the body.
+  char hex[20];
+  int len = snprintf(hex, sizeof(hex), "%zx" CRLF, size);
+  s.append(hex, len);
+  s.append(data, size);
+  s.append(CRLF);
+}
+
+static void after_stream_write(uv_write_t *req, int status) {
+  static_cast<ResponseImpl*>(req->data)->after_stream_write(status);
+}
+
+bool ResponseImpl::write_chunk(const char *data, size_t size) {
+  assert(state == 0);   // Not after end() or send().
+  if (stream_failed || c->closing()) return false;
+  streaming = true;
+  if (head) size = 0;   // Only the header is written.
+  if (body_buffer.size()) {
+    if (!head) append_chunk(stream_pending, body_buffer.data(), body_buffer.size());
+    body_buffer.assign(string());
+  }
+  append_chunk(stream_pending, data, size);
+  if (c->responses.front() == this) pump(::simple_http::after_stream_write);
+  return stream_pending.size() + stream_out.size() < STREAM_HIGH_WATER;
+}
+
+void ResponseImpl::pump(uv_write_cb cb) {
+  if (stream_writing || (header_sent && stream_pending.empty())) return;
+  Worker *w = c->worker;
+  int nbufs = 0;
+  uv_buf_t bufs[2];
+  if (!header_sent) {
+    w->take_header_buffer(header);
+    append_head(header, 0, 0);
+    header.append("Date: ");
+    w->date.append_to(header, time(NULL));
+    header.append(CRLF CRLF);
+    bufs[nbufs++] = uv_buf_init(&header[0], header.size());
+    header_sent = true;
+  }
+  stream_out.swap(stream_pending);
+  if (!stream_out.empty()) bufs[nbufs++] = uv_buf_init(&stream_out[0], stream_out.size());
+  c->server->stats.sent_bytes.inc(stream_out.size() + (nbufs == 2 ? header.size() : 0));
+  stream_writing = true;
+  write_req.data = this;
+  int error = c->write(&write_req, bufs, nbufs, cb);
+  if (error) {
+    Log::severe("Could not write %d for request %s", error, prefix->c_str());
+    stream_writing = false;
+  }
+}
+
+void ResponseImpl::after_stream_write(int status) {
+  stream_writing = false;
+  stream_out.clear();
+  if (status < 0) stream_failed = true;
+  bool closed = stream_failed || c->closing();
+  if (closed) stream_pending.clear();
+  if (state == 2) return closed ? finish() : end_stream();
+  if (state == 1) return c->cleanup();    // Flushes the end, or drops this response.
+  if (!closed && !stream_pending.empty()) return pump(::simple_http::after_stream_write);
+  if (drain_cb) {
+    // The handler may set another callback or end the response.
+    function<void()> cb;
+    cb.swap(drain_cb);
+    cb();
+  }
+}
+
+void ResponseImpl::end_stream() {
+  if (!head) {
+    if (body_buffer.size()) append_chunk(stream_pending, body_buffer.data(), body_buffer.size());
+    stream_pending.append("0" CRLF CRLF);
+  }
+
+  auto dur = duration_cast<microseconds>(high_resolution_clock::now() - start_time).count();
+  c->server->stats.response.add(dur);
+  latency.add(dur);
+
+  // The last write completes the response.
+  if (header_sent && stream_pending.empty()) return finish();   // Of a HEAD request.
+  pump(write_cb);
+}
+
+Connection::Connection(Worker *w):
+    worker(w), server(w->server), num_writing(0), close_when_done(false), over_capacity(false) {
+  handle.data = this;
+  write_req.data = this;
+  // Log::warn("Connection created %p", this);
+}
+
+Connection::~Connection() {
+  // Log::warn("Connection destroyed %p", this);
+}
+
+ResponseImpl* Connection::create_response(const string *prefix, Histogram latency) {
+  ResponseImpl* res = worker->response_pool.create(this, prefix, latency);
+  server->stats.response_impl_alloc.inc();
+  responses.push_back(res);
+  return res;
+}
+
+void Connection::cleanup() {
+  flush_responses();
+  if (disposeable()) {
+    server->stats.connection_dealloc.inc();
+    server->num_connections.fetch_sub(1, std::memory_order_relaxed);
+    // Log::warn("Connection DELETE: %p", this);
+    worker->connection_pool.destroy(this);
+  }
+}
+
+void Connection::flush_responses() {
+  bool closed = the_parser.state == HttpParserState::CLOSED;
+  while (!responses.empty()) {
+    ResponseImpl* res = responses.front();
+    int state = res->get_state();
+    if (state == 0) {
+      // Not yet responded, but a streamed response can start.
+      if (res->streaming && !res->stream_failed && !closing()) res->pump(after_stream_write);
+      return;
+    }
+    if (res->stream_writing) return; // Wait for the chunks being written.
+    if (state == 2 && !res->ready) return; // Being compressed or written.
+    if (state != 3 && !closed) return write_responses();
+    responses.pop_front();
+    server->stats.response_impl_dealloc.inc();
+    worker->response_pool.destroy(res);
+  }
+  if (close_when_done && !closing()) the_parser.close();
+}
+
+static void after_responses_write(uv_write_t *req, int status) {
+  static_cast<Connection*>(req->data)->after_write(status);
+}
+
+// The consecutive responses at the head that are sent (flushed on the way)
+// are written together, up to max_write_batch bytes, so that a pipelining
+// client gets them with one system call and one loop iteration.
+void Connection::write_responses() {
+  vector<uv_buf_t> &bufs = worker->write_bufs;
+  bufs.clear();
+  size_t n = 0, bytes = 0;
+  for (ResponseImpl *res : responses) {
+    if (res->get_state() == 1) {
+      if (res->streaming) {
+        if (!n) res->flush(after_flush);   // Written by itself.
+        break;
+      }
+      res->flush(after_flush);
+    }
+    if (res->get_state() != 2 || !res->ready) break;
+    if (n && bytes + res->ready_size() > server->max_write_batch) break;
+    bytes += res->ready_size();
+    res->append_bufs(bufs);
+    n++;
+  }
+  if (!n) return;
+  num_writing = n;
+  server->stats.write.inc();
+  int error = write(&write_req, bufs.data(), bufs.size(), after_responses_write);
+  if (error) {
+    Log::severe("Could not write %d for %zu responses", error, n);
+    after_write(error);
+  }
+}
+
+int Connection::write(uv_write_t *req, const uv_buf_t bufs[], unsigned nbufs, uv_write_cb cb) {
+#ifdef SIMPLE_HTTP_IO_URING
+  if (the_parser.uring) return the_parser.uring->write(req, bufs, nbufs, cb);
+#endif
+  return uv_write(req, (uv_stream_t*) &handle, bufs, nbufs, cb);
+}
 
-  ostringstream ss; 
-  switch (code) {
-    case Response::Code::OK: ss << "HTTP/1.1 200 OK" CRLF CORS_HEADERS; break;
-    case Response::Code::NOT_FOUND: ss << "HTTP/1.1 400 URL Request Error" CRLF CORS_HEADERS; break;
-    case Response::Code::SERVER_ERROR: ss << "HTTP/1.1 500 Internal Server Error" CRLF CORS_HEADERS; break;
-    default: Log::severe("unknown code %d", code); assert(0); break;
+void Connection::after_write(int status) {
+  // The responses are recycled together by cleanup().
+  for (size_t i = 0; i < num_writing; i++) responses[i]->written();
+  num_writing = 0;
+  cleanup();
+}
+
+static bool starts_with(const string &s, const string &prefix) {
+  return !s.compare(0, prefix.size(), prefix);
+}
+
+bool Connection::admit(Request &req, InFlightLimit **limit) {
+  *limit = nullptr;
+  for (auto &p : server->priority_prefixes) {
+    if (starts_with(req.url, p)) return true;
   }
-  string body_str = body.str();
-  ss << "Content-Length: " << body_str.length() << "\r\n";
-  if (max_age_s > 0) {
-    ss << "Cache-Control: public,max-age=" << max_age_s << "\r\n";
-    if (last_modified > 0) {
-      time_t t = last_modified;
-      char buffer[80];
-      strftime(buffer, 80, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
-      ss << "Last-Modified: " << buffer << std::endl;
-      // ss << "Last-Modified: " << std::put_time(gmtime(&t), "%a, %d %b %Y %H:%M:%S GMT") << std::endl;
+  Counter *shed = nullptr;
+  if (over_capacity) {
+    shed = &server->stats.shed_connection;
+    close_when_done = true;
+  } else if (server->max_pipelined && (int) responses.size() >= server->max_pipelined) {
+    shed = &server->stats.shed_pipelined;
+  } else {
+    for (auto &l : server->in_flight_limits) {
+      if (starts_with(req.url, l->prefix) && (!*limit || l->prefix.size() > (*limit)->prefix.size())) {
+        *limit = l.get();
+      }
+    }
+    if (*limit && (*limit)->count.fetch_add(1, std::memory_order_relaxed) >= (*limit)->max) {
+      (*limit)->count.fetch_sub(1, std::memory_order_relaxed);
+      *limit = nullptr;
+      shed = &server->stats.shed_in_flight;
     }
   }
-  ss << "\r\n" << body_str << "\r\n";
+  if (!shed) return true;
+  shed->inc();
+  Response res { create_response(&server->unknown_prefix, server->unknown_latency) };
+  res.body() << "Service unavailable for " << req.url;
+  res.send(Response::Code::SERVICE_UNAVAILABLE);
+  return false;
+}
 
-  string s = ss.str();
-  send_buffer.base = new char[send_buffer.len = s.length()];
-  c->server->varz.inc("server_send_buffer_alloc");
-  memcpy(send_buffer.base, s.data(), send_buffer.len);
-  c->server->varz.inc("server_sent_bytes", send_buffer.len);
+// Copies the request, whose views point into the read buffer.
+static void copy_request(const Request &src, OffloadedRequest &dst) {
+  dst.req.method = src.method;
+  dst.req.url = src.url;
+  dst.req.params = src.params;
+  auto &headers = src.headers.list();
+  size_t size = src.raw_url.size() + src.body.size();
+  for (auto &h : headers) size += h.name.size() + h.value.size();
+  dst.data.reserve(size);
+  dst.data.append(src.raw_url.data(), src.raw_url.size());
+  for (auto &h : headers) {
+    dst.data.append(h.name.data(), h.name.size());
+    dst.data.append(h.value.data(), h.value.size());
+  }
+  dst.data.append(src.body.data(), src.body.size());
+  const char *p = dst.data.data();
+  dst.req.raw_url = StringView(p, src.raw_url.size());
+  p += src.raw_url.size();
+  for (auto &h : headers) {
+    dst.req.headers.add(StringView(p, h.name.size()), StringView(p + h.name.size(), h.value.size()));
+    p += h.name.size() + h.value.size();
+  }
+  dst.req.body = StringView(p, src.body.size());
+}
 
-  auto dur = duration_cast<microseconds>(high_resolution_clock::now() - start_time).count();
-  c->server->varz.latency("server_response", dur);
-  c->server->varz.latency(url, dur);
-  if (dur * 1e-3 >= max_runtime_ms) {
-    Log::warn("runtime = %6.3lf, prefix = %s", dur * 1e-6, url.c_str());
+void Connection::offload(Route *route, Request &req, ResponseImpl *impl) {
+  unique_ptr<OffloadedRequest> r(new OffloadedRequest());
+  r->route = route;
+  r->res = impl;
+  copy_request(req, *r);
+  if (server->handler_pool.submit(std::move(r))) {
+    server->stats.offloaded.inc();
+    return;
   }
+  server->stats.shed_offload.inc();
+  Response res { impl };
+  res.body() << "Service unavailable for " << req.url;
+  res.send(Response::Code::SERVICE_UNAVAILABLE);
+}
 
-  write_req.data = this;
-  int error = uv_write((uv_write_t*) &write_req, (uv_stream_t*) &c->handle, &send_buffer, 1, cb);
-  if (error) Log::severe("Could not write %d for request %s", error, url.c_str());
+bool Connection::disposeable() {
+  return the_parser.state == HttpParserState::CLOSED && responses.empty();
 }
 
 
+/***** Handler pool *****/
 
-Connection::Connection(ServerImpl *s): server(s) {
-  handle.data = this;
-  // Log::warn("Connection created %p", this);
+HandlerPool::~HandlerPool() {
+  {
+    lock_guard<mutex> lock(mu);
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto &t : threads) t.join();
 }
 
-Connection::~Connection() {
-  // Log::warn("Connection destroyed %p", this);
+void HandlerPool::start(int num_threads, size_t max_queued) {
+  assert(threads.empty() && num_threads > 0);
+  this->max_queued = max_queued;
+  for (int i = 0; i < num_threads; i++) threads.push_back(std::thread(&HandlerPool::run, this));
 }
 
-ResponseImpl* Connection::create_response(string prefix) {
-  ResponseImpl* res = new ResponseImpl(this, prefix);
-  server->varz.inc("server_response_impl_alloc");
-  responses.push(res);
-  return res;
+bool HandlerPool::submit(unique_ptr<OffloadedRequest> r) {
+  {
+    lock_guard<mutex> lock(mu);
+    if (tasks.size() >= max_queued) return false;
+    tasks.push_back(std::move(r));
+  }
+  ready.notify_one();
+  return true;
 }
 
-void Connection::cleanup() {
-  flush_responses();
-  if (disposeable()) {
-    server->varz.inc("server_connection_dealloc");
-    // Log::warn("Connection DELETE: %p", this);
-    delete this;
+size_t HandlerPool::queued() {
+  lock_guard<mutex> lock(mu);
+  return tasks.size();
+}
+
+void HandlerPool::run() {
+  while (true) {
+    unique_ptr<OffloadedRequest> r;
+    {
+      std::unique_lock<mutex> lock(mu);
+      ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+      if (stopping) return;
+      r = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    Response res { r->res };
+    r->route->handler(r->req, res);
   }
 }
 
-void Connection::flush_responses() {
-  while (!responses.empty()) {
-    ResponseImpl* res = responses.front();
-    if (res->get_state() == 0) return; // Not yet responded.
-    if (res->get_state() == 1 && the_parser.state != HttpParserState::CLOSED) return res->flush(after_flush);
-    if (res->get_state() == 2) return; // Not yet written.
-    responses.pop();
-    server->varz.inc("server_response_impl_dealloc");
-    delete res;
+
+/***** Logger *****/
+
+int Log::max_level = Log::INFO;
+
+// A bounded multi-producer queue of formatted messages, drained by one
+// background thread (Vyukov's bounded queue: a producer claims a cell by
+// advancing tail, formats into it, then publishes it through its sequence).
+// Producers never block: when the queue is full the message is dropped.
+class LogQueue {
+ public:
+  static constexpr unsigned CAPACITY = 1024;      // Power of two.
+  static constexpr unsigned MAX_MESSAGE = 512;    // Longer messages are truncated.
+
+  LogQueue(): tail(0), head(0), written(0), dropped(0), reported_dropped(0), idle(false) {
+    for (unsigned i = 0; i < CAPACITY; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    std::thread(&LogQueue::drain, this).detach();
+  }
+
+  // Returns the position of the message, or 0 if it was dropped.
+  unsigned long long push(int level, unsigned suppressed, const char *fmt, va_list args) {
+    unsigned long long pos = tail.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells[pos & (CAPACITY - 1)];
+      long long diff = (long long) cell->seq.load(std::memory_order_acquire) - (long long) pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    cell->level = level;
+    int n = vsnprintf(cell->text, MAX_MESSAGE, fmt, args);
+    n = n < 0 ? 0 : min(n, (int) MAX_MESSAGE - 1);
+    if (suppressed && n < (int) MAX_MESSAGE - 1) {
+      int m = snprintf(cell->text + n, MAX_MESSAGE - n, " (%u similar suppressed)", suppressed);
+      n = min(n + max(m, 0), (int) MAX_MESSAGE - 1);
+    }
+    cell->len = n;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    if (idle.exchange(false)) wake.notify_one();
+    return pos + 1;
+  }
+
+  // Waits until the messages up to position pos are written.
+  void wait_written(unsigned long long pos) {
+    std::unique_lock<mutex> lock(mu);
+    flushed.wait(lock, [&] { return written.load() >= pos; });
+  }
+
+  unsigned long long tail_position() { return tail.load(); }
+  unsigned long long num_dropped() { return dropped.load(std::memory_order_relaxed); }
+
+ private:
+  struct Cell {
+    std::atomic<unsigned long long> seq;
+    int level;
+    int len;
+    char text[MAX_MESSAGE];
+  };
+
+  // Writes the queued messages in batches, one write per batch.
+  void drain() {
+    static const char* const prefixes[] = {
+      "\e[00;31mSEVERE\e[00m ", "\e[1;33mWARN\e[00m ", "\e[0;32mINFO\e[00m " };
+    string batch;
+    while (true) {
+      batch.clear();
+      while (batch.size() < 64 * 1024) {
+        Cell &cell = cells[head & (CAPACITY - 1)];
+        if (cell.seq.load(std::memory_order_acquire) != head + 1) break;
+        batch.append(prefixes[cell.level]);
+        batch.append(cell.text, cell.len);
+        batch.push_back('\n');
+        cell.seq.store(head + CAPACITY, std::memory_order_release);
+        head++;
+      }
+      unsigned long long d = dropped.load(std::memory_order_relaxed);
+      if (d != reported_dropped) {
+        batch.append(prefixes[Log::WARN]);
+        batch.append(std::to_string(d - reported_dropped) + " log messages dropped\n");
+        reported_dropped = d;
+      }
+      if (batch.empty()) {
+        std::unique_lock<mutex> lock(mu);
+        idle.store(true);
+        // Rechecks after announcing idleness; the timeout covers a producer
+        // that published before seeing idle.
+        Cell &cell = cells[head & (CAPACITY - 1)];
+        if (cell.seq.load(std::memory_order_acquire) != head + 1) {
+          wake.wait_for(lock, milliseconds(100));
+        }
+        continue;
+      }
+      fwrite(batch.data(), 1, batch.size(), stderr);
+      fflush(stderr);
+      {
+        lock_guard<mutex> lock(mu);
+        written.store(head);
+      }
+      flushed.notify_all();
+    }
   }
+
+  Cell cells[CAPACITY];
+  std::atomic<unsigned long long> tail;
+  unsigned long long head;                    // Only used by the drain thread.
+  std::atomic<unsigned long long> written;
+  std::atomic<unsigned long long> dropped;
+  unsigned long long reported_dropped;        // Only used by the drain thread.
+  std::atomic<bool> idle;
+  mutex mu;
+  std::condition_variable wake;
+  std::condition_variable flushed;
+};
+
+// Never destroyed, so that messages can be logged until the process exits.
+static LogQueue& log_queue() {
+  static LogQueue *q = new LogQueue();
+  return *q;
 }
 
-bool Connection::disposeable() {
-  return the_parser.state == HttpParserState::CLOSED && responses.empty();
+static void flush_log_at_exit() {
+  Log::flush();
 }
 
+static void log_message(int level, unsigned suppressed, const char *fmt, va_list args) {
+  static int registered = atexit(flush_log_at_exit);
+  (void) registered;
+  unsigned long long pos = log_queue().push(level, suppressed, fmt, args);
 
-/***** Logger *****/
+  // Severe messages often precede abort(), wait until they are written.
+  if (pos && level == Log::SEVERE) log_queue().wait_written(pos);
+}
 
-#define LOG_FMT_STDERR(prefix)        \
-  va_list args; va_start(args, fmt);  \
-  fprintf(stderr, prefix);            \
-  vfprintf(stderr, fmt, args);        \
-  fprintf(stderr, "\n");              \
+#define LOG_AT_LEVEL(level)             \
+  if (level > max_level) return;        \
+  va_list args; va_start(args, fmt);    \
+  log_message(level, 0, fmt, args);     \
   va_end(args);
 
-void Log::severe(const char *fmt, ... ) { LOG_FMT_STDERR("\e[00;31mSEVERE\e[00m ") }
-void Log::warn(const char *fmt, ... ) { LOG_FMT_STDERR("\e[1;33mWARN\e[00m ") }
-void Log::info(const char *fmt, ... ) { LOG_FMT_STDERR("\e[0;32mINFO\e[00m ") }
+void Log::severe(const char *fmt, ... ) { LOG_AT_LEVEL(SEVERE) }
+void Log::warn(const char *fmt, ... ) { LOG_AT_LEVEL(WARN) }
+void Log::info(const char *fmt, ... ) { LOG_AT_LEVEL(INFO) }
+
+#undef LOG_AT_LEVEL
+
+void Log::flush() {
+  log_queue().wait_written(log_queue().tail_position());
+}
+
+unsigned long long Log::dropped() {
+  return log_queue().num_dropped();
+}
+
+Log::RateLimit::RateLimit(int interval_ms): interval_ms(interval_ms), next_ms(0), suppressed(0) {}
 
-#undef LOG_FMT_STDERR
+void Log::RateLimit::warn(const char *fmt, ... ) {
+  if (WARN > max_level) return;
+  long long now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+  long long next = next_ms.load(std::memory_order_relaxed);
+  if (now < next || !next_ms.compare_exchange_strong(next, now + interval_ms)) {
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  log_message(WARN, suppressed.exchange(0), fmt, args);
+  va_end(args);
+}
 
 
 
@@ -469,33 +3766,73 @@ static int on_header_value(http_parser* parser, const char* at, size_t len) {
   return static_cast<HttpParser*>(parser->data)->append_header_value(at, len);
 }
 
-static int on_headers_complete(http_parser* parser) {
-  return static_cast<HttpParser*>(parser->data)->append_header_field("", 0);
-}
-
 static int on_body(http_parser* parser, const char* p, size_t len) {
   return static_cast<HttpParser*>(parser->data)->append_body(p, len);
 }
 
+static int on_message_begin(http_parser* parser) {
+  static_cast<HttpParser*>(parser->data)->in_message = true;
+  return 0;
+}
+
+static Method to_method(unsigned int m) {
+  switch (m) {
+    case HTTP_GET: return Method::GET;
+    case HTTP_HEAD: return Method::HEAD;
+    case HTTP_POST: return Method::POST;
+    case HTTP_PUT: return Method::PUT;
+    case HTTP_DELETE: return Method::DELETE;
+    case HTTP_OPTIONS: return Method::OPTIONS;
+    default: return Method::OTHER;
+  }
+}
+
+// Hands the body of a streamed route to the handler, or checks the body limit.
+static int on_headers_complete(http_parser* parser) {
+  HttpParser* c = static_cast<HttpParser*>(parser->data);
+  bool has_body = (parser->flags & F_CHUNKED) ||
+    (parser->content_length > 0 && parser->content_length != ULLONG_MAX);
+  if (!has_body || c->state == HttpParserState::CLOSED) return 0;
+  if (c->headers_cb) {
+    c->build_request();
+    c->request.method = to_method(parser->method);
+    c->streaming_body = c->headers_cb(c->request);
+    if (c->streaming_body) return 0;
+    c->request.clear();
+  }
+  if (c->max_body_size && parser->content_length != ULLONG_MAX &&
+      parser->content_length > c->max_body_size) {
+    return c->reject(413);
+  }
+  return 0;
+}
+
 static int on_message_complete(http_parser* parser) {
   HttpParser* c = static_cast<HttpParser*>(parser->data);
-  if (c->state != HttpParserState::CLOSED) {
+  if (c->streaming_body) {
+    if (c->body_stream.on_end) c->body_stream.on_end();
+    c->reset();
+    c->resume();    // In case on_end paused.
+  } else if (c->state != HttpParserState::CLOSED) {
     c->build_request();
-    c->request.body = c->body_.str();
-    // Log::info("on_message_complete parser %p : %s", c, c->request.body.c_str());
+    c->request.method = to_method(parser->method);
+    // Log::info("on_message_complete parser %p : %.*s", c, (int) c->request.body.size(), c->request.body.data());
     c->msg_cb(c->request);
     c->reset(); // Recycle the HttpParser and request object.
   }
   return 0;   // Continue parsing.
 }
 
-HttpParser::HttpParser() {
+HttpParser::HttpParser():
+    uring(nullptr), num_copies(0), max_header_size(0), max_body_size(0), rejected(0),
+    body_stream(this), paused(false), parsing(false) {
   memset(&parser_settings, 0, sizeof(http_parser_settings));
   parser_settings.on_url = on_url;
   parser_settings.on_header_field = on_header_field;
   parser_settings.on_header_value = on_header_value;
-  parser_settings.on_headers_complete = on_headers_complete;
   parser_settings.on_body = on_body;
+  parser_settings.on_message_begin = on_message_begin;
+  parser_settings.on_headers_complete = on_headers_complete;
   parser_settings.on_message_complete = on_message_complete;
 
   parser.data = this;
@@ -506,17 +3843,12 @@ HttpParser::HttpParser() {
 HttpParser::~HttpParser() {}
 
 static void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t *buf) {
-  HttpParser* c = static_cast<HttpParser*>(handle->data);
-  assert(suggested_size == MAX_BUFFER_LEN); // libuv dependent code.
-  buf->base = c->buffer;
+  buf->base = read_buffers().create()->data;
   buf->len = MAX_BUFFER_LEN;
 }
 
 static void on_close(uv_handle_t* handle) {
-  HttpParser* c = static_cast<HttpParser*>(handle->data);
-  assert(c && c->state != HttpParserState::CLOSED);
-  c->state = HttpParserState::CLOSED;
-  c->close_cb();
+  static_cast<HttpParser*>(handle->data)->closed();
 }
 
 static void on_read(uv_stream_t* tcp, ssize_t nread, const uv_buf_t *buf) {
@@ -524,10 +3856,17 @@ static void on_read(uv_stream_t* tcp, ssize_t nread, const uv_buf_t *buf) {
   assert(c);
   // Log::info("on_read parser %p, nread = %d", c, nread);
   // Log::info("%.*s", buf->len, buf->base);
-  if (nread < 0 || !c->parse(buf->base, nread)) {
+  if (nread == 0) {
+    // EAGAIN, e.g. after a read that filled the buffer. Not the end of the
+    // stream, which http_parser_execute would take a length of 0 for.
+  } else if (nread < 0) {
     assert(c->state != HttpParserState::CLOSED);
     c->close();
+  } else if (!c->parse(buf->base, nread)) {
+    assert(c->state != HttpParserState::CLOSED);
+    c->fail();
   }
+  if (buf->base) read_buffers().destroy(reinterpret_cast<ReadBuffer*>(buf->base));
 }
 
 void HttpParser::start(
@@ -536,31 +3875,135 @@ void HttpParser::start(
     function<void(Request&)> on_message_complete,
     function<void()> on_close_cb) {
   tcp = stream;
-  stream->data = this;
+  if (stream) stream->data = this;    // Otherwise reads from uring.
+  reset();                  // The stream may replace a closed one.
+  rejected = 0;
+  paused = false;
+  held.clear();
   msg_cb = on_message_complete;
   close_cb = on_close_cb;
   http_parser_init(&parser, type);
-  uv_read_start(stream, on_alloc, on_read);
+  read_start();
 }
 
 void HttpParser::close() {
+#ifdef SIMPLE_HTTP_IO_URING
+  if (uring) return uring->close();
+#endif
   uv_close((uv_handle_t*) tcp, on_close);
 }
 
-static void clear_ss(ostringstream &ss) { ss.clear(); ss.str(""); }
+void HttpParser::closed() {
+  assert(state != HttpParserState::CLOSED);
+  state = HttpParserState::CLOSED;
+  close_cb();
+}
+
+bool HttpParser::closing() {
+#ifdef SIMPLE_HTTP_IO_URING
+  if (uring) return uring->closing();
+#endif
+  return uv_is_closing((uv_handle_t*) tcp);
+}
+
+void HttpParser::read_start() {
+#ifdef SIMPLE_HTTP_IO_URING
+  if (uring) return uring->read_start();
+#endif
+  uv_read_start(tcp, on_alloc, on_read);
+}
+
+void HttpParser::read_stop() {
+#ifdef SIMPLE_HTTP_IO_URING
+  if (uring) return uring->read_stop();
+#endif
+  uv_read_stop(tcp);
+}
+
+void HttpParser::fail() {
+  if (rejected && reject_cb) {
+    read_stop();
+    reject_cb(rejected);
+  } else {
+    close();
+  }
+}
+
+void HttpParser::pause() {
+  if (paused || state == HttpParserState::CLOSED) return;
+  paused = true;
+  http_parser_pause(&parser, 1);
+  read_stop();
+}
+
+void HttpParser::resume() {
+  if (!paused || state == HttpParserState::CLOSED || closing()) return;
+  paused = false;
+  http_parser_pause(&parser, 0);
+  if (!parsing) {
+    // Inside http_parser_execute, unpausing lets it carry on with the same input.
+    string input;
+    input.swap(held);
+    if (!input.empty() && !parse(input.data(), input.size())) {
+      fail();
+      return;
+    }
+  }
+  if (!paused) read_start();
+}
 
 void HttpParser::reset() {
   state = HttpParserState::READING_URL;
-  clear_ss(temp_hf_);
-  clear_ss(temp_hv_);
-  clear_ss(url_);
-  clear_ss(body_);
+  url_ = body_ = MessagePart();
+  headers_.clear();
+  // Do not keep the memory of large messages on idle connections.
+  for (int i = 0; i < num_copies; i++) {
+    if (copies[i].capacity() > 4096) string().swap(copies[i]);
+  }
+  num_copies = 0;
+  in_message = false;
   request.clear();
+  header_size = body_size = 0;
+  streaming_body = false;
+  body_stream.on_data = nullptr;
+  body_stream.on_end = nullptr;
+}
+
+int HttpParser::new_copy() {
+  if (num_copies == (int) copies.size()) copies.push_back(string());
+  copies[num_copies].clear();
+  return num_copies++;
+}
+
+void HttpParser::append(MessagePart &part, const char *p, size_t len) {
+  if (part.slot < 0) {
+    if (!part.len) part.p = p;
+    if (part.p + part.len == p) {
+      part.len += len;
+      return;
+    }
+    copy(part);
+  }
+  copies[part.slot].append(p, len);
+  part.len += len;
+}
+
+void HttpParser::copy(MessagePart &part) {
+  if (part.slot >= 0 || !part.len) return;
+  part.slot = new_copy();
+  copies[part.slot].assign(part.p, part.len);
+}
+
+StringView HttpParser::view(const MessagePart &part) {
+  if (part.slot < 0) return StringView(part.p, part.len);
+  return StringView(copies[part.slot]);
 }
 
 int HttpParser::append_url(const char *p, size_t len) {
   assert(state == HttpParserState::READING_URL);
-  url_.write(p, len);
+  header_size += len;
+  if (max_header_size && header_size > max_header_size) return reject(431);
+  append(url_, p, len);
   return 0;
 }
 
@@ -575,68 +4018,98 @@ static char to_hex(char code) {
   return hex[code & 15];
 }
 
-/* Returns a url-decoded version of str */
-static char* url_decode(char *str, char *buf) {
-  char *pstr = str, *pbuf = buf;
-  while (*pstr) {
-    if (*pstr == '%') {
-      if (pstr[1] && pstr[2]) {
-        *pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-        pstr += 2;
+/* Appends the url-decoded version of src to dst */
+static void url_decode(StringView src, string &dst) {
+  for (size_t i = 0; i < src.size(); i++) {
+    if (src[i] == '%') {
+      if (i + 2 < src.size()) {
+        dst.push_back(from_hex(src[i + 1]) << 4 | from_hex(src[i + 2]));
+        i += 2;
       }
-    } else if (*pstr == '+') {
-      *pbuf++ = ' ';
+    } else if (src[i] == '+') {
+      dst.push_back(' ');
     } else {
-      *pbuf++ = *pstr;
+      dst.push_back(src[i]);
     }
-    pstr++;
   }
-  *pbuf = '\0';
-  return buf;
 }
 
 void HttpParser::build_request() {
-  if (state == HttpParserState::READING_URL) {
-    request.url = url_.str();
-    char *url = (char*) request.url.c_str();
-    url_decode(url, url);
-    state = HttpParserState::READING_HEADER_FIELD;
-  }
-  if (state == HttpParserState::READING_HEADER_VALUE) {
-    request.headers[temp_hf_.str()] = temp_hv_.str();
-    clear_ss(temp_hf_);
-    clear_ss(temp_hv_);
-    state = HttpParserState::READING_HEADER_FIELD;
-  }
+  request.raw_url = view(url_);
+  url_decode(request.raw_url, request.url);
+  for (auto &h : headers_) request.headers.add(view(h.first), view(h.second));
+  request.body = view(body_);
 }
 
 int HttpParser::append_header_field(const char *p, size_t len) {
-  build_request();
-  temp_hf_.write(p, len);
+  if (state != HttpParserState::READING_HEADER_FIELD) {
+    headers_.push_back(make_pair(MessagePart(), MessagePart()));
+    state = HttpParserState::READING_HEADER_FIELD;
+  }
+  header_size += len + 4;   // With ": " and CRLF.
+  if (max_header_size && header_size > max_header_size) return reject(431);
+  append(headers_.back().first, p, len);
   return 0;
 }
 
 int HttpParser::append_header_value(const char *p, size_t len) {
   assert(state != HttpParserState::READING_URL);
-  if (state == HttpParserState::READING_HEADER_FIELD) {
-    state = HttpParserState::READING_HEADER_VALUE;
-    temp_hv_.write(p, len);
-  }
+  state = HttpParserState::READING_HEADER_VALUE;
+  header_size += len;
+  if (max_header_size && header_size > max_header_size) return reject(431);
+  append(headers_.back().second, p, len);
   return 0;
 }
 
 int HttpParser::append_body(const char *p, size_t len) {
   // Log::info("body = %.*s", len, p);
-  body_.write(p, len);
+  if (streaming_body) {
+    if (body_stream.on_data) body_stream.on_data(StringView(p, len));
+    return 0;
+  }
+  body_size += len;
+  if (max_body_size && body_size > max_body_size) return reject(413);
+  append(body_, p, len);
   return 0;
 }
 
+int HttpParser::reject(int status) {
+  rejected = status;
+  return -1;
+}
+
 bool HttpParser::parse(const char *buf, ssize_t nread) {
+  assert(nread > 0);
+  parsing = true;
   ssize_t parsed = http_parser_execute(&parser, &parser_settings, buf, nread);
-  assert(parsed <= nread);
+  parsing = false;
+  enum http_errno err = HTTP_PARSER_ERRNO(&parser);
+  if (err == HPE_PAUSED) {
+    // The body stream is paused: keep the rest for resume().
+    held.assign(buf + parsed, nread - parsed);
+    parsed = nread;
+  } else if (err != HPE_OK) {
+    // Malformed input is answered with 400, unless a limit rejected it first
+    // or the body was being streamed to a handler, which a close ends.
+    // Log::info("parse error %s", http_errno_name(err));
+    if (!rejected && !streaming_body) rejected = 400;
+    return false;
+  }
+  if (in_message && state != HttpParserState::CLOSED) {
+    // The rest of the message comes in the next reads, into the same buffer.
+    copy(url_);
+    for (auto &h : headers_) {
+      copy(h.first);
+      copy(h.second);
+    }
+    copy(body_);
+  }
   return parsed == nread;
 }
 
+void BodyStream::pause() { parser->pause(); }
+void BodyStream::resume() { parser->resume(); }
+
 
 /***** Http Client *****/
 
@@ -648,27 +4121,110 @@ enum class ClientState {
   WAITING
 };
 
+class ClientImpl;
+struct ClientCall;
+
+// A request of the client, kept until its response arrives so that it can
+// be sent again after a reconnection.
+struct ClientRequest {
+  string url;
+  shared_ptr<const string> body;  // Shared with the writes in progress, or null.
+  time_point<steady_clock> start;
+  shared_ptr<ClientCall> call;    // Answered instead of the callback, if not null.
+};
+
+// A pending write of one request: the head and the body are written together
+// without copying the body. Small heads are formatted inline so that
+// recycling the object through a Pool needs no allocation at all.
+struct ClientWrite {
+  ClientWrite(ClientImpl *c): client(c) { req.data = this; }
+
+  uv_write_t req;
+  ClientImpl *client;
+  char inline_data[512];
+  string data;              // Used for heads larger than inline_data.
+  shared_ptr<const string> body;
+};
+
 class ClientImpl {
  public:
   ClientImpl(const char *h, int p);
 
   void request(const char *url, const string &body, function<void(const string&)> response_callback);
+  void send(ClientRequest &&r, function<void(const string&)> response_callback);
   void flush();
-  void try_connect();
+  void write(const ClientRequest &r);
+  void try_connect(bool now = false);   // After the backoff timeout, unless now.
   void close();
 
+  // Called when the connection is lost: the requests it sent are sent again
+  // if they are idempotent (without a body), and failed otherwise.
+  void recover_sent();
+
   const string host;
   int port;
   int timeout;
+  uv_loop_t *loop;          // The loop of the thread that created this client.
   uv_connect_t connect_req;
   uv_timer_t connect_timer;
   uv_tcp_t handle;
   HttpParser the_parser;    // The parser for the TCP stream handle.
+  Pool<ClientWrite> write_pool;
 
-  queue<pair<string, string>> req_queue; // url, body.
-  queue<function<void(const string&)>> cb_queue;
+  deque<ClientRequest> req_queue;   // The requests without response, in order.
+  deque<function<void(const string&)>> cb_queue;
+  size_t num_sent;          // The requests at the front of req_queue written on this connection.
+  size_t pipeline_depth;    // Maximum number of requests waiting for their response.
   ClientState connection_status;
-  bool is_idle;
+  bool reconnect_now;       // Closed by a deadline rather than lost.
+  function<void(ClientImpl*)> on_down;  // Called when connecting fails or the connection is lost.
+  function<void(const ClientRequest&)> on_response;   // Called before the callback of a request.
+};
+
+// The statistics of the requests made with RequestOptions by a ClientPool.
+struct CallStats {
+  explicit CallStats(Varz &varz):
+    retries(varz.counter("client_retries")),
+    hedges(varz.counter("client_hedges")),
+    deadline_exceeded(varz.counter("client_deadline_exceeded")) {}
+
+  Counter retries;
+  Counter hedges;
+  Counter deadline_exceeded;
+};
+
+// A request made with RequestOptions, which may be sent several times: the
+// first response (or the deadline) answers it and the others are dropped.
+struct ClientCall : std::enable_shared_from_this<ClientCall> {
+  ClientCall(): stats(nullptr), hedge_delay_ms(0), retries(0), hedged(false), done(false) {}
+
+  // Sends the request and starts the timer of the deadline and hedging.
+  void start(uv_loop_t *loop);
+
+  // Sends the request on the connection returned by pick.
+  void attempt(const ClientImpl *avoid);
+
+  void on_response(ClientImpl *c, int status, StringView body);
+  void on_lost();           // The POST was sent on a connection that was lost.
+  void on_timer();
+  void arm();               // Starts the timer for the next hedge or the deadline.
+  void expire();
+  void finish(RequestError error, const string &body);
+  void close_timer();
+
+  ClientRequest request;
+  RequestOptions options;
+  ResultCallback callback;
+  function<ClientImpl*(const ClientImpl *avoid)> pick;   // Preferably not avoid.
+  CallStats *stats;             // Of the pool, or null.
+  int hedge_delay_ms;           // 0 for no hedging.
+  time_point<steady_clock> deadline;
+  vector<ClientImpl*> sent_to;  // The connections of the attempts.
+  int retries;
+  bool hedged;
+  bool done;
+  uv_timer_t timer;
+  shared_ptr<ClientCall> self;  // Keeps the call while the timer is open.
 };
 
 static void on_connect(uv_connect_t *req, int status);
@@ -676,7 +4232,7 @@ static void try_connect_cb(uv_timer_t* handle) {
   ClientImpl *c = (ClientImpl*) handle->data;
   Log::warn("Connecting to %s:%d", c->host.c_str(), c->port);
   c->connection_status = ClientState::CONNECTING;
-  uv_tcp_init(uv_default_loop(), &c->handle);
+  uv_tcp_init(c->loop, &c->handle);
 
   struct sockaddr_in dest;
   uv_ip4_addr(c->host.c_str(), c->port, &dest);
@@ -694,16 +4250,18 @@ static void on_connect(uv_connect_t *req, int status) {
     Log::severe("on_connect by %s:%d, queue = %lu/%lu\n",
       c->host.c_str(), c->port, c->req_queue.size(), c->cb_queue.size());
     c->connection_status = ClientState::DISCONNECTED;
+    uv_close((uv_handle_t*) &c->handle, nullptr);
     c->try_connect();
     c->timeout = min(c->timeout * 2, 8000);
+    if (c->on_down) c->on_down(c);
     return;
   }
 
   c->timeout = 1000;
-  Log::info("CONNECTED %s:%d, queue=%d/%d, readable=%d, writable=%d, status=%d, is_idle=%d",
+  Log::info("CONNECTED %s:%d, queue=%d/%d, readable=%d, writable=%d, status=%d",
     c->host.c_str(), c->port, c->req_queue.size(), c->cb_queue.size(),
-    uv_is_readable(req->handle), uv_is_writable(req->handle), status, c->is_idle);
-  c->is_idle = true;
+    uv_is_readable(req->handle), uv_is_writable(req->handle), status);
+  c->num_sent = 0;          // Nothing is sent yet on this connection.
   c->connection_status = ClientState::CONNECTED;
 
   assert(uv_is_readable(req->handle));
@@ -714,11 +4272,17 @@ static void on_connect(uv_connect_t *req, int status) {
   c->the_parser.start((uv_stream_t*) &c->handle, HTTP_RESPONSE,
     [c](Request &req) {
       // On message complete.
-      assert(!c->cb_queue.empty());
-      c->cb_queue.front()(req.body);
-      c->cb_queue.pop();
-      c->req_queue.pop();
-      c->is_idle = true;
+      assert(!c->cb_queue.empty() && c->num_sent > 0);
+      ClientRequest &r = c->req_queue.front();
+      if (c->on_response) c->on_response(r);
+      if (r.call) {
+        r.call->on_response(c, c->the_parser.parser.status_code, req.body);
+      } else {
+        c->cb_queue.front()(req.body.str());
+      }
+      c->cb_queue.pop_front();
+      c->req_queue.pop_front();
+      c->num_sent--;
       c->flush();
       // Log::info("complete qsize = %d/%d, %d", 
       //   c->req_queue.size(), c->cb_queue.size(), c->connection_status == ClientState::CONNECTED);
@@ -726,10 +4290,17 @@ static void on_connect(uv_connect_t *req, int status) {
     }, [c] () {
       // On close.
       if (c->connection_status == ClientState::CONNECTED) {
-        Log::severe("Connection closed %s:%d, reconnecting", c->host.c_str(), c->port);
+        if (c->reconnect_now) {
+          Log::info("Connection closed %s:%d after a deadline, reconnecting", c->host.c_str(), c->port);
+        } else {
+          Log::severe("Connection closed %s:%d, reconnecting", c->host.c_str(), c->port);
+        }
         c->connection_status = ClientState::DISCONNECTED;
         c->timeout = 1000;
-        c->try_connect();
+        c->try_connect(c->reconnect_now);
+        c->reconnect_now = false;
+        c->recover_sent();
+        if (c->on_down) c->on_down(c);
       } else {
         Log::info("Client DISCONNECTED");
       }
@@ -746,44 +4317,87 @@ void Client::request(const char *url, const string &body,
   impl->request(url, body, response_callback);
 }
 
+void Client::request(const char *url, const string &body, const RequestOptions &options,
+    ResultCallback result_callback) {
+  auto call = std::make_shared<ClientCall>();
+  call->request = ClientRequest { url, body.empty() ? nullptr : std::make_shared<const string>(body), steady_clock::now() };
+  call->options = options;
+  if (options.hedge_percentile) {
+    static Log::RateLimit ignored_hedges(1000);
+    ignored_hedges.warn("Hedged requests need a ClientPool, sending %s without hedging", url);
+    call->options.hedge_percentile = 0;
+  }
+  call->callback = result_callback;
+  ClientImpl *c = impl.get();
+  call->pick = [c](const ClientImpl *avoid) { return c; };
+  call->start(c->loop);
+}
+
+void Client::set_pipeline_depth(int depth) {
+  assert(depth >= 1);
+  impl->pipeline_depth = depth;
+}
+
 void Client::close() {
   impl->close();
 }
 
 ClientImpl::ClientImpl(const char *h, int p): host(h), port(p) {
+  loop = current_worker ? current_worker->loop : uv_default_loop();
   connect_req.data = this;
   connection_status = ClientState::UNINITED;
+  reconnect_now = false;
+  uv_timer_init(loop, &connect_timer);
   connect_timer.data = this;
   timeout = 1000;
-  is_idle = false;
+  num_sent = 0;
+  pipeline_depth = 1;
 }
 
 void ClientImpl::request(const char *url, const string &body, function<void(const string&)> response_callback) {
-  req_queue.push(make_pair(url, body));
-  cb_queue.push(response_callback);
+  send(ClientRequest { url, body.empty() ? nullptr : std::make_shared<const string>(body), steady_clock::now() },
+    response_callback);
+}
+
+void ClientImpl::send(ClientRequest &&r, function<void(const string&)> response_callback) {
+  req_queue.push_back(std::move(r));
+  cb_queue.push_back(response_callback);
   // Log::info("request qsize = %d/%d, %d",
   //   req_queue.size(), cb_queue.size(), connection_status == ClientState::CONNECTED);
   if (connection_status == ClientState::CONNECTED) {
     flush();
-  } else {
+  } else if (connection_status != ClientState::CONNECTING) {
     try_connect();
   }
 }
 
 static void after_write(uv_write_t *req, int status) {
   // Log::info("after_write");
-  assert(status == 0);
-  free(req->data);
-  free(req);
-}
-
-static void write_string(char *s, int length, uv_tcp_t* tcp) {
-  // Log::info("writing: %.*s", length, s);
-  uv_buf_t buf = uv_buf_init(s, length);
-  uv_write_t *req = (uv_write_t*) malloc(sizeof(*req));
-  req->data = malloc(length);
-  memcpy((char*) req->data, s, length);
-  if (uv_write(req, (uv_stream_t*)tcp, &buf, 1, after_write)) {
+  // On failure the connection is closed, and the request sent again.
+  ClientWrite *w = static_cast<ClientWrite*>(req->data);
+  w->client->write_pool.destroy(w);
+}
+
+void ClientImpl::write(const ClientRequest &r) {
+  ClientWrite *w = write_pool.create(this);
+  const char *fmt = r.body
+    ? "POST %s HTTP/1.1\r\nContent-Type: multipart/form-data\r\nContent-Length: %zu\r\n\r\n"
+    : "GET %s HTTP/1.1\r\n\r\n";
+  size_t length = r.body ? r.body->size() : 0;
+  char *head = w->inline_data;
+  int n = snprintf(head, sizeof(w->inline_data), fmt, r.url.c_str(), length);
+  if (n >= (int) sizeof(w->inline_data)) {
+    w->data.resize(n + 1);
+    head = &w->data[0];
+    snprintf(head, n + 1, fmt, r.url.c_str(), length);
+  }
+  uv_buf_t bufs[2] = { uv_buf_init(head, n) };
+  unsigned nbufs = 1;
+  if (r.body) {
+    w->body = r.body;
+    bufs[nbufs++] = uv_buf_init((char*) r.body->data(), length);
+  }
+  if (uv_write(&w->req, (uv_stream_t*) &handle, bufs, nbufs, after_write)) {
     Log::severe("uv_write failed");
     assert(0);
   }
@@ -791,41 +4405,55 @@ static void write_string(char *s, int length, uv_tcp_t* tcp) {
 
 void ClientImpl::flush() {
   if (connection_status == ClientState::CONNECTED) {
-    if (is_idle && !req_queue.empty()) {
-      char url[1024];
-      assert(!cb_queue.empty());
-      const char *path = req_queue.front().first.c_str();
-      // Log::info("flush %s con=%d, qsize=%d", path, connection_status, cb_queue.size());
-      if (req_queue.front().second.length()) {
-        int length = req_queue.front().second.length();
-        sprintf(url, "POST %s HTTP/1.1\r\nContent-Type: multipart/form-data\r\nContent-Length: %d\r\n\r\n", path, length);
-        write_string(url, strlen(url), &handle);
-        write_string((char*) req_queue.front().second.data(), length, &handle);
-        sprintf(url + 1000, "\r\n");
-        write_string(url + 1000, strlen(url + 1000), &handle);
-      } else {
-        sprintf(url, "GET %s HTTP/1.1\r\n\r\n", path);
-        write_string(url, strlen(url), &handle);
+    // Closed by a deadline, from whose callback more requests may be sent:
+    // they wait for the reconnection.
+    if (uv_is_closing((uv_handle_t*) &handle)) return;
+    assert(cb_queue.size() == req_queue.size());
+    // Log::info("flush con=%d, qsize=%d, sent=%d", connection_status, cb_queue.size(), num_sent);
+    while (num_sent < pipeline_depth && num_sent < req_queue.size()) {
+      ClientRequest &r = req_queue[num_sent];
+      if (r.call && r.call->done) {
+        // Failed or answered on another connection before it was sent.
+        req_queue.erase(req_queue.begin() + num_sent);
+        cb_queue.erase(cb_queue.begin() + num_sent);
+        continue;
       }
-      is_idle = false;
-    } else {
-      // Log::info("Waiting for result of previous call");
+      write(r);
+      num_sent++;
     }
   } else if (!cb_queue.empty()) {
     Log::warn("Failed flush, not connected, cb_queue size = %d", cb_queue.size());
   }
 }
 
-void ClientImpl::try_connect() {
+void ClientImpl::recover_sent() {
+  // The server may have run the sent POSTs, so they are failed rather than
+  // sent twice. They leave the queues first: their callbacks may send more.
+  vector<pair<ClientRequest, function<void(const string&)>>> failed;
+  for (size_t i = num_sent; i-- > 0; ) {
+    if (!req_queue[i].body) continue;
+    failed.emplace_back(std::move(req_queue[i]), std::move(cb_queue[i]));
+    req_queue.erase(req_queue.begin() + i);
+    cb_queue.erase(cb_queue.begin() + i);
+  }
+  num_sent = 0;
+  for (auto it = failed.rbegin(); it != failed.rend(); ++it) {
+    if (it->first.call) {
+      it->first.call->on_lost();
+    } else {
+      it->second("");
+    }
+  }
+}
+
+void ClientImpl::try_connect(bool now) {
   switch (connection_status) {
     case ClientState::CONNECTED: Log::severe("Already connected"); assert(0); break;
     case ClientState::CONNECTING: Log::severe("Try double connect"); assert(0); break;
     case ClientState::WAITING: /* Log::info("Try connect: state WAITING"); */ break;
     case ClientState::DISCONNECTED: Log::info("Try connect: state DISCONNECTED");
-      uv_timer_stop(&connect_timer);
     case ClientState::UNINITED: Log::info("Try connect: state UNINITED");
-      uv_timer_init(uv_default_loop(), &connect_timer);
-      uv_timer_start(&connect_timer, try_connect_cb, timeout, 0);
+      uv_timer_start(&connect_timer, try_connect_cb, now ? 0 : timeout, 0);
       connection_status = ClientState::WAITING;
       break;
   }
@@ -838,10 +4466,266 @@ void ClientImpl::close() {
       the_parser.close();
       break;
     case ClientState::CONNECTING: Log::severe("CONNECTING"); assert(0); break;
-    case ClientState::WAITING: Log::info("WAITING"); assert(0); break;
+    case ClientState::WAITING:
+      uv_timer_stop(&connect_timer);    // No more reconnections.
+      connection_status = ClientState::DISCONNECTED;
+      break;
     case ClientState::DISCONNECTED: Log::info("Already DISCONNECTED"); the_parser.close(); break;
     case ClientState::UNINITED: Log::info("UNINITED"); assert(0); break;
   }
 }
 
+void ClientCall::start(uv_loop_t *loop) {
+  attempt(nullptr);
+  bool hedge = hedge_delay_ms && !request.body;   // Only idempotent requests are sent twice.
+  if (!options.deadline_ms && !hedge) return;
+  deadline = request.start + milliseconds(options.deadline_ms);
+  self = shared_from_this();
+  uv_timer_init(loop, &timer);
+  timer.data = this;
+  arm();
+}
+
+void ClientCall::attempt(const ClientImpl *avoid) {
+  ClientImpl *c = pick(avoid);
+  sent_to.push_back(c);
+  ClientRequest r = request;
+  r.start = steady_clock::now();
+  r.call = shared_from_this();
+  c->send(std::move(r), nullptr);
+}
+
+void ClientCall::on_response(ClientImpl *c, int status, StringView body) {
+  if (done) return;         // Answered by another attempt, or too late.
+  if (status >= 500 && !request.body && retries < options.max_retries) {
+    retries++;
+    if (stats) stats->retries.inc();
+    attempt(c);
+    return;
+  }
+  finish(status >= 500 ? RequestError::SERVER_ERROR : RequestError::NONE, body.str());
+}
+
+void ClientCall::on_lost() {
+  if (!done) finish(RequestError::CONNECTION_LOST, "");
+}
+
+static void on_call_timer(uv_timer_t *timer) {
+  static_cast<ClientCall*>(timer->data)->on_timer();
+}
+
+void ClientCall::arm() {
+  long long left = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+  if (hedge_delay_ms && !request.body && !hedged) {
+    long long ms = duration_cast<milliseconds>(request.start + milliseconds(hedge_delay_ms) - steady_clock::now()).count();
+    if (options.deadline_ms) ms = min(ms, left);
+    uv_timer_start(&timer, on_call_timer, max(ms, 0LL), 0);
+  } else if (options.deadline_ms) {
+    uv_timer_start(&timer, on_call_timer, max(left, 0LL), 0);
+  } else {
+    close_timer();
+  }
+}
+
+void ClientCall::on_timer() {
+  if (done) return;
+  if (hedged || !hedge_delay_ms || (options.deadline_ms && steady_clock::now() >= deadline)) return expire();
+  hedged = true;
+  if (stats) stats->hedges.inc();
+  attempt(sent_to.back());
+  arm();
+}
+
+void ClientCall::expire() {
+  for (ClientImpl *c : sent_to) {
+    // The responses behind a sent request wait for it, so reconnect at once.
+    // The other requests sent on the connection are then sent again, or
+    // failed for POSTs, by recover_sent(), and those queued behind follow.
+    for (size_t i = 0; i < c->num_sent; i++) {
+      if (c->req_queue[i].call.get() != this) continue;
+      if (c->connection_status == ClientState::CONNECTED && !uv_is_closing((uv_handle_t*) &c->handle)) {
+        c->reconnect_now = true;
+        c->the_parser.close();
+      }
+      break;
+    }
+  }
+  if (stats) stats->deadline_exceeded.inc();
+  finish(RequestError::DEADLINE_EXCEEDED, "");
+}
+
+void ClientCall::finish(RequestError error, const string &body) {
+  done = true;
+  callback(error, body);
+  close_timer();
+}
+
+void ClientCall::close_timer() {
+  if (!self || uv_is_closing((uv_handle_t*) &timer)) return;
+  uv_close((uv_handle_t*) &timer, [](uv_handle_t *h) {
+    static_cast<ClientCall*>(h->data)->self.reset();
+  });
+}
+
+
+/***** Client Pool *****/
+
+// A connection of the pool, with the statistics of its backend.
+struct PoolConnection {
+  unique_ptr<ClientImpl> client;
+  Counter responses;
+  Counter errors;
+  Histogram latency;
+};
+
+class ClientPoolImpl {
+ public:
+  ClientPoolImpl(const vector<string> &backends, int connections_per_backend);
+
+  // The connected connection with the fewest requests waiting, or the one
+  // with the fewest requests if none is connected. Connections to the
+  // backend of avoid come last.
+  PoolConnection* pick(const ClientImpl *avoid = nullptr);
+  void send(ClientRequest &&r, function<void(const string&)> response_callback);
+
+  // Moves the requests of a connection that went down to the others. The
+  // POSTs it had written were already failed by recover_sent().
+  void redistribute(ClientImpl *down);
+
+  // The percentile of the recent response latencies, 0 if too few are known.
+  int latency_percentile_ms(int percentile);
+
+  Varz varz;
+  CallStats call_stats;
+  vector<PoolConnection> connections;
+  size_t next;              // Where pick() starts, to spread the ties.
+  vector<int> recent_us;    // Ring of the latencies of the recent responses.
+  size_t recent_next;
+  int cached_percentile;    // The last computed percentile, until 64 more responses.
+  int cached_ms;
+  int responses_since;
+};
+
+ClientPoolImpl::ClientPoolImpl(const vector<string> &backends, int connections_per_backend):
+    call_stats(varz), next(0), recent_next(0), cached_percentile(0), cached_ms(0), responses_since(0) {
+  assert(!backends.empty() && connections_per_backend >= 1);
+  for (auto &b : backends) {
+    size_t colon = b.rfind(':');
+    string host = b.substr(0, colon);
+    int port = colon == string::npos ? 80 : atoi(b.c_str() + colon + 1);
+    for (int i = 0; i < connections_per_backend; i++) {
+      PoolConnection pc;
+      pc.client.reset(new ClientImpl(host.c_str(), port));
+      pc.responses = varz.counter("client_responses:" + b);
+      pc.errors = varz.counter("client_errors:" + b);
+      pc.latency = varz.histogram("client_latency:" + b);
+      connections.push_back(std::move(pc));
+    }
+  }
+  for (auto &pc : connections) {
+    PoolConnection *p = &pc;
+    p->client->on_down = [this](ClientImpl *c) { redistribute(c); };
+    p->client->on_response = [this, p](const ClientRequest &r) {
+      int us = duration_cast<microseconds>(steady_clock::now() - r.start).count();
+      p->responses.inc();
+      p->latency.add(us);
+      if (recent_us.size() < 1024) recent_us.push_back(us); else recent_us[recent_next++ % 1024] = us;
+      responses_since++;
+    };
+    p->client->try_connect();
+  }
+}
+
+PoolConnection* ClientPoolImpl::pick(const ClientImpl *avoid) {
+  PoolConnection *best = nullptr;
+  int best_rank = 0;
+  size_t n = connections.size();
+  for (size_t i = 0; i < n; i++) {
+    PoolConnection *pc = &connections[(next + i) % n];
+    ClientImpl *c = pc->client.get();
+    bool other_backend = !avoid || c->port != avoid->port || c->host != avoid->host;
+    int rank = (c->connection_status == ClientState::CONNECTED) * 4 + other_backend * 2 + (c != avoid);
+    if (!best || rank > best_rank || (rank == best_rank &&
+        c->cb_queue.size() < best->client->cb_queue.size())) {
+      best = pc;
+      best_rank = rank;
+    }
+  }
+  next = (next + 1) % n;
+  return best;
+}
+
+int ClientPoolImpl::latency_percentile_ms(int percentile) {
+  if (recent_us.size() < 32) return 0;
+  if (percentile != cached_percentile || responses_since >= 64) {
+    vector<int> v(recent_us);
+    size_t k = min(v.size() - 1, v.size() * percentile / 100);
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    cached_percentile = percentile;
+    cached_ms = v[k] / 1000 + 1;
+    responses_since = 0;
+  }
+  return cached_ms;
+}
+
+void ClientPoolImpl::send(ClientRequest &&r, function<void(const string&)> response_callback) {
+  pick()->client->send(std::move(r), response_callback);
+}
+
+void ClientPoolImpl::redistribute(ClientImpl *down) {
+  assert(!down->num_sent);
+  for (auto &pc : connections) {
+    if (pc.client.get() == down) pc.errors.inc();
+  }
+  bool any_connected = false;
+  for (auto &pc : connections) {
+    any_connected |= pc.client->connection_status == ClientState::CONNECTED;
+  }
+  if (!any_connected) return;   // Wait for a reconnection.
+  while (!down->req_queue.empty()) {
+    ClientRequest r = std::move(down->req_queue.front());
+    function<void(const string&)> cb = std::move(down->cb_queue.front());
+    down->req_queue.pop_front();
+    down->cb_queue.pop_front();
+    pick()->client->send(std::move(r), cb);
+  }
+}
+
+ClientPool::ClientPool(const vector<string> &backends, int connections_per_backend):
+  impl(unique_ptr<ClientPoolImpl>(new ClientPoolImpl(backends, connections_per_backend))) {}
+ClientPool::~ClientPool() {}
+
+void ClientPool::request(const char *url, const string &body,
+    function<void(const string&)> response_callback) {
+  impl->send(ClientRequest { url, body.empty() ? nullptr : std::make_shared<const string>(body), steady_clock::now() },
+    response_callback);
+}
+
+void ClientPool::request(const char *url, const string &body, const RequestOptions &options,
+    ResultCallback result_callback) {
+  auto call = std::make_shared<ClientCall>();
+  call->request = ClientRequest { url, body.empty() ? nullptr : std::make_shared<const string>(body), steady_clock::now() };
+  call->options = options;
+  call->callback = result_callback;
+  call->stats = &impl->call_stats;
+  ClientPoolImpl *pool = impl.get();
+  call->pick = [pool](const ClientImpl *avoid) { return pool->pick(avoid)->client.get(); };
+  if (options.hedge_percentile) call->hedge_delay_ms = pool->latency_percentile_ms(options.hedge_percentile);
+  call->start(pool->connections[0].client->loop);
+}
+
+void ClientPool::set_pipeline_depth(int depth) {
+  assert(depth >= 1);
+  for (auto &pc : impl->connections) pc.client->pipeline_depth = depth;
+}
+
+void ClientPool::close() {
+  for (auto &pc : impl->connections) {
+    ClientState status = pc.client->connection_status;
+    if (status == ClientState::CONNECTED || status == ClientState::WAITING) pc.client->close();
+  }
+}
+
+Varz* ClientPool::varz() { return &impl->varz; }
+
 };
@@ -1,68 +1,317 @@
 #ifndef SIMPLE_HTTP_
 #define SIMPLE_HTTP_
 
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
+#include <ostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 namespace simple_http {
 
   using std::map;
   using std::string;
   using std::unique_ptr;
+  using std::ostream;
   using std::ostringstream;
+  using std::vector;
+
+  enum class Method {
+    GET,
+    HEAD,
+    POST,
+    PUT,
+    DELETE,
+    OPTIONS,
+    OTHER,
+  };
+
+  // A reference to characters owned by someone else, usually the read buffer
+  // of the connection. It does not outlive the handler call it is passed to.
+  class StringView {
+   public:
+    StringView(): p(nullptr), n(0) {}
+    StringView(const char *s, size_t len): p(s), n(len) {}
+    StringView(const string &s): p(s.data()), n(s.size()) {}
+
+    const char* data() const { return p; }
+    size_t size() const { return n; }
+    size_t length() const { return n; }
+    bool empty() const { return !n; }
+    const char* begin() const { return p; }
+    const char* end() const { return p + n; }
+    char operator[](size_t i) const { return p[i]; }
+
+    string str() const { return string(p, n); }
+    operator string() const { return str(); }
+
+    // The read-only methods of string, for the code written when the request
+    // body was one. There is no c_str(), a view is not NUL-terminated.
+    static const size_t npos = string::npos;
+    size_t find(char c, size_t pos = 0) const {
+      for (size_t i = pos; i < n; i++) if (p[i] == c) return i;
+      return npos;
+    }
+    size_t find(const char *s, size_t pos = 0) const { return find(StringView(s, strlen(s)), pos); }
+    size_t find(StringView s, size_t pos = 0) const {
+      if (pos > n) return npos;
+      const char *i = std::search(p + pos, p + n, s.p, s.p + s.n);
+      return i == p + n && s.n ? npos : i - p;
+    }
+    StringView substr(size_t pos, size_t len = npos) const {
+      pos = std::min(pos, n);
+      return StringView(p + pos, std::min(len, n - pos));
+    }
+    int compare(StringView o) const {
+      int r = memcmp(p, o.p, std::min(n, o.n));
+      return r ? r : (n < o.n ? -1 : n > o.n);
+    }
+
+    bool operator==(StringView o) const { return n == o.n && std::equal(p, p + n, o.p); }
+    bool operator!=(StringView o) const { return !(*this == o); }
+    bool operator==(const char *s) const { return *this == StringView(s, strlen(s)); }
+    bool operator!=(const char *s) const { return !(*this == s); }
+
+    // ASCII case-insensitive comparison, e.g. for header names.
+    bool equals_ignore_case(StringView o) const {
+      if (n != o.n) return false;
+      for (size_t i = 0; i < n; i++) {
+        if (tolower((unsigned char) p[i]) != tolower((unsigned char) o.p[i])) return false;
+      }
+      return true;
+    }
+
+   private:
+    const char *p;
+    size_t n;
+  };
+
+  // Request headers, kept as a flat array of views in arrival order.
+  class Headers {
+   public:
+    struct Header {
+      StringView name;
+      StringView value;
+    };
+
+    Headers(): copied(false) {}
+
+    // Returns the value of the first header with the specified name
+    // (case-insensitive), or an empty view if there is none.
+    StringView get(StringView name) const;
+
+    const vector<Header>& list() const { return views; }
+    void add(StringView name, StringView value) { views.push_back(Header { name, value }); }
+    void clear();
+
+    // Compatibility with map<string, string>: copies the headers into a map on
+    // first use, which also keeps them valid after the handler returns.
+    string& operator[](const string &name) { return as_map()[name]; }
+    size_t count(const string &name) { return as_map().count(name); }
+    map<string, string>::iterator find(const string &name) { return as_map().find(name); }
+    map<string, string>::iterator begin() { return as_map().begin(); }
+    map<string, string>::iterator end() { return as_map().end(); }
+    size_t size() const { return views.size(); }
+    bool empty() const { return views.empty(); }
+
+   private:
+    map<string, string>& as_map();
+
+    vector<Header> views;
+    map<string, string> copies;
+    bool copied;
+  };
 
+  // An http request. The headers and the body are views into the read buffer
+  // of the connection (copied only when the request spans several reads), so
+  // copy what is needed after the handler returns, e.g. for async responses.
+  // The body used to be a string: code calling string methods that views do
+  // not have, e.g. c_str(), uses body_string() instead.
   class Request {
    public:
-    map<string, string> headers;
-    string url;
-    string body;
+    // A capture of the matched route pattern, e.g. ":a<int>" in "/add/:a<int>".
+    struct Param {
+      const string *name;   // Owned by the server.
+      string value;         // The captured part of the URL.
+      long long number;     // The parsed value of an <int> capture, 0 otherwise.
+    };
+
+    Method method;
+    string url;             // URL-decoded, reuses its capacity across requests.
+    StringView raw_url;     // As received, a view like the headers.
+    Headers headers;
+    StringView body;
+    vector<Param> params;   // Captures of the matched route, in pattern order.
+
+    // Returns the capture with the specified name, or nullptr if there is none.
+    const Param* param(const string &name) const {
+      for (auto &p : params) if (*p.name == name) return &p;
+      return nullptr;
+    }
+
+    // Returns a copy of the body.
+    string body_string() const { return body.str(); }
+
+    // Returns the value of the header (case-insensitive), or an empty view.
+    StringView header(const char *name) const { return headers.get(StringView(name, strlen(name))); }
 
     void clear() {
+      method = Method::OTHER;
+      url.clear();
+      raw_url = StringView();
       headers.clear();
-      url = body = "";
+      body = StringView();
+      params.clear();
     }
   };
 
   class ResponseImpl;
 
+  // The body of a response, written to the client without being copied. It
+  // keeps the str() methods of the ostringstream it replaces.
+  class ResponseBody : public ostream {
+   public:
+    explicit ResponseBody(std::streambuf *buf): ostream(buf) {}
+
+    // Returns a copy of what was written.
+    string str() const;
+
+    // Replaces what was written with s, the next writes append to it.
+    void str(const string &s);
+  };
+
   // The Response class can be used for asynchronous processing.
   class Response {
    public:
     enum class Code {
       OK,
       NOT_FOUND,
+      METHOD_NOT_ALLOWED,
+      NOT_MODIFIED,
+      PARTIAL_CONTENT,
+      RANGE_NOT_SATISFIABLE,
+      PAYLOAD_TOO_LARGE,
+      HEADER_FIELDS_TOO_LARGE,
+      SERVICE_UNAVAILABLE,
       SERVER_ERROR,
+      BAD_REQUEST,
     };
 
     Response(ResponseImpl*);
     ~Response();
 
-    // Response body. Fill this before calling send() or flush().
-    ostringstream& body();
+    // Response body. Fill this before calling send().
+    // The body is written to the client without being copied. It used to be
+    // an ostringstream, code binding it to an ostringstream& uses an ostream&.
+    ResponseBody& body();
+
+    // Replaces the response body with an already built string (moved, not copied).
+    void set_body(string body);
 
     // Enable HTTP Cache for the specified seconds (default not specified).
     // An optional last modified header may be specified to improve HTTP caching.
     void set_max_age(int seconds, int last_modified = 0);
 
+    // Sets the Content-Type header (default "application/json; charset=utf-8").
+    void set_content_type(const string &content_type);
+
+    // Sets the ETag header, a validator of the body (W/"etag" when weak).
+    // Declare the validators (this and the last modified time) before
+    // producing the body, see not_modified().
+    void set_etag(const string &etag, bool weak = false);
+
+    // Whether the request is a conditional GET (If-None-Match or
+    // If-Modified-Since) matching the declared validators. The handler may
+    // then skip producing the body: send() answers 304 Not Modified.
+    // Matching requests get a 304 even if this is not called.
+    bool not_modified();
+
     // Prints warning to the console if the send() method is called later than
     // the specified milliseconds after the handler is called (default = 500 ms).
     void set_max_runtime_warning(int milliseconds);
 
     // Sends the response to the client with the specified code.
     // No more appends to body allowed after calling send().
+    // It may be called from any thread: the response is then sent by the loop
+    // of the connection. The other methods must be called by the thread
+    // running the handler, or the one calling send(), except the streaming
+    // ones below (write_chunk(), on_drain(), closed() and end()), which must
+    // be called on the loop of the connection.
     void send(Code code = Code::OK);
 
+    // Streams the body with "Transfer-Encoding: chunked" instead of sending
+    // it at once: each call writes what is in body() and then data as chunks,
+    // in pipelining order (chunks are queued until the previous responses are
+    // sent). Returns false when more than 1 MB waits to be written, or the
+    // client is gone: stop producing until on_drain() is called.
+    bool write_chunk(const char *data, size_t size);
+    bool write_chunk(const string &data) { return write_chunk(data.data(), data.size()); }
+
+    // Calls callback once, when the chunks written so far are sent.
+    void on_drain(std::function<void()> callback);
+
+    // Whether the client closed the connection, e.g. a streaming handler
+    // should then end() without producing the rest of the body.
+    bool closed();
+
+    // Ends a streamed response, writing what is left in body() as the last
+    // chunk. Must be called instead of send() after write_chunk().
+    void end();
+
+    // Sends the file at path instead of the body, with its content type,
+    // Last-Modified and ETag (so that conditional GETs get a 304), honoring a
+    // single byte Range (206 or 416). Sends 404 if it is not a regular file.
+    // The file is mapped into memory and written without copying; mappings
+    // are cached, so replace served files atomically (rename) rather than
+    // truncating them in place.
+    void send_file(const string &path);
+
    private:
     // Not owned by this class.
     ResponseImpl* impl;
   };
 
   class VarzImpl;
+  class HdrLayout;
+
+  // A pre-registered counter of a Varz, see Varz::counter().
+  class Counter {
+   public:
+    Counter(): impl(nullptr), slot(0) {}
+    void inc(unsigned long long value = 1);
+
+    // Sets the calling thread's value; the printed value is the sum over threads.
+    void set(unsigned long long value);
+
+   private:
+    friend class Varz;
+    VarzImpl *impl;
+    unsigned slot;
+  };
+
+  // A pre-registered latency histogram of a Varz, see Varz::histogram().
+  class Histogram {
+   public:
+    Histogram(): impl(nullptr), slot(0), layout(nullptr) {}
+    void add(int us);
+
+   private:
+    friend class Varz;
+    VarzImpl *impl;
+    unsigned slot;
+    const HdrLayout *layout;
+  };
 
   // Statistis for monitoring.
+  // Each thread updates its own copy of the statistics without locking;
+  // the copies are summed when the statistics are read.
   class Varz {
    public:
     Varz();
@@ -71,7 +320,22 @@ namespace simple_http {
     void set(string key, unsigned long long value);
     void inc(string key, unsigned long long value = 1);
     void latency(string key, int us);
-    void print_to(ostringstream &ss);
+    void print_to(ostream &ss);
+
+    // Adds all counters and latency histograms of this Varz into total.
+    void add_to(Varz &total);
+
+    // Registers the key once and returns a handle for cheap updates on hot
+    // paths, e.g. "static Counter ok = app().varz()->counter("OK");".
+    // The handles are valid as long as this Varz and can be used from any thread.
+    Counter counter(const string &key);
+
+    // Latency histograms record values with 1 to 3 significant digits (the
+    // first registration of a key decides) and are printed as power-of-two
+    // buckets since start, followed by "<key>:percentiles" with the count,
+    // p50, p90, p99, p99.9 and max since start and in the last complete
+    // 10 seconds, minute and 10 minutes. latency() uses 2 significant digits.
+    Histogram histogram(const string &key, int significant_digits = 2);
 
    private:
     unique_ptr<VarzImpl> impl;
@@ -79,8 +343,41 @@ namespace simple_http {
 
   typedef std::function<void(Request&, Response&)> Handler;
 
+  class HttpParser;
+
+  // The body of a request streamed to its handler, see Server::stream().
+  // It is valid until the response is sent.
+  class BodyStream {
+   public:
+    explicit BodyStream(HttpParser *parser): parser(parser) {}
+
+    // Called with each part of the body as it arrives. The data is only valid
+    // during the call.
+    std::function<void(StringView data)> on_data;
+
+    // Called once the whole body was received.
+    std::function<void()> on_end;
+
+    // Stops reading from the client until resume(), e.g. while the data is
+    // written somewhere slower than the network.
+    void pause();
+    void resume();
+
+   private:
+    HttpParser *parser;
+  };
+
+  typedef std::function<void(Request&, Response&, BodyStream&)> StreamHandler;
+
   class ServerImpl;
 
+  // How the server accepts, reads and writes its connections, see
+  // Server::set_io_engine().
+  enum class IoEngine {
+    LIBUV,
+    IO_URING,
+  };
+
   class Server {
    public:
     Server();
@@ -90,45 +387,270 @@ namespace simple_http {
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
 
-    // Handles http requests where the URL matches the specified prefix.
-    void get(string prefix, Handler);
+    // Handles GET requests where the URL matches the specified pattern.
+    // A pattern matches the URLs it is a prefix of, or only the whole URL (up to
+    // the query string) when it ends with '$'. The longest match wins.
+    // A pattern may capture parts of the URL into Request::params:
+    // ":name" captures up to the next '/' or '?' and ":name<int>" an integer,
+    // e.g. "/add/:a<int>,:b<int>" matches "/add/2,3".
+    // HEAD requests are handled by the GET handlers, and answered with the
+    // headers of the response without its body. Requests of other methods
+    // no longer reach get() handlers (they used to get every method): they
+    // are answered with 405 unless a handler is registered for the method,
+    // e.g. with post() or route().
+    void get(string pattern, Handler);
+
+    // Same as get() for POST and OPTIONS requests. OPTIONS requests for
+    // URLs that only have handlers for other methods get an empty response.
+    void post(string pattern, Handler);
+    void options(string pattern, Handler);
+
+    // Handles requests of the specified method, see get().
+    void route(Method method, string pattern, Handler);
+
+    // Handles the requests of the method whose URL matches pattern (see get())
+    // with the body streamed to the handler instead of buffered: the handler
+    // is called as soon as the headers are received (Request::body is empty)
+    // and sets the callbacks of the BodyStream. The buffered body size limit
+    // does not apply.
+    void stream(Method method, string pattern, StreamHandler);
+
+    // Handles the requests of the method whose URL matches pattern (see get())
+    // on the threads of a bounded pool instead of the event loop, e.g. for
+    // CPU-heavy handlers. The request is copied for the handler, which may
+    // send the response from the pool thread. The requests are answered with
+    // 503 when too many of them wait for a thread, see set_offload_threads().
+    // Such a handler must answer with send(): streaming a response with
+    // write_chunk() and end() is only possible on the loop.
+    void offload(Method method, string pattern, Handler);
+
+    // The number of threads running the offloaded handlers (default 0, one
+    // per CPU) and the maximum number of requests waiting for them
+    // (default 1024). Call this before listen().
+    void set_offload_threads(int num_threads, size_t max_queued = 1024);
+
+    // Serves the files under the root directory for the GET requests whose URL
+    // starts with prefix, e.g. static_dir("/static/", "www") sends
+    // "www/app.js" for "/static/app.js" and "www/index.html" for "/static/".
+    // URLs with ".." segments are rejected. See Response::send_file().
+    void static_dir(string prefix, string root, int max_age = 0);
 
     // Starts the http server at the specified address and port.
     void listen(string address, int port);
 
-    // Server statistics.
+    // Starts the http server with num_workers event loops, each on its own thread
+    // with its own listening socket (SO_REUSEPORT, or a shared socket otherwise).
+    // Handlers run on the loop that accepted the connection, so they may be
+    // called concurrently and must be thread-safe when num_workers > 1.
+    // If pin_cpus is true, worker i is pinned to CPU (i % number of CPUs).
+    void listen(string address, int port, int num_workers, bool pin_cpus = false);
+
+    // Maximum number of recycled connection and response objects kept by each
+    // worker (default 1024). The pools are trimmed down to their recent
+    // high-water mark every 10 seconds. Call this before listen().
+    void set_pool_capacity(int max_free_objects);
+
+    // Limits the size of the request line and headers (default 64 KB) and of
+    // the buffered request bodies (default 64 MB). Larger requests are
+    // answered with 431 or 413 without being buffered, and the connection is
+    // closed. Call this before listen().
+    void set_request_limits(size_t max_header_size, size_t max_body_size);
+
+    // Sheds load with 503 Service Unavailable and a Retry-After of
+    // retry_after_s seconds instead of queueing it: beyond max_connections
+    // open connections, the requests of new connections are shed and the
+    // connections closed; a connection with max_pipelined requests not yet
+    // answered gets 503 for the next ones (0 for no limit). The requests
+    // with a priority prefix are never shed.
+    // Call this before listen().
+    void set_admission_limits(int max_connections, int max_pipelined, int retry_after_s = 1);
+
+    // Sheds the requests whose URL starts with url_prefix while max_in_flight
+    // of them are not yet answered. The longest matching prefix applies.
+    // Call this before listen().
+    void limit_in_flight(string url_prefix, int max_in_flight);
+
+    // The requests whose URL starts with url_prefix are never shed, e.g.
+    // health checks. "/varz" is a priority prefix. Call this before listen().
+    void add_priority_prefix(string url_prefix);
+
+    // The maximum length of the queue of connections not yet accepted
+    // (default 128). Call this before listen().
+    void set_listen_backlog(int backlog);
+
+    // Selects the I/O engine of the connections (default LIBUV). With
+    // IO_URING, each worker accepts with a multishot accept, receives into a
+    // ring of provided buffers with a multishot recv and submits the writes of
+    // a loop iteration together; everything else still runs on the libuv
+    // loop. It needs Linux 5.19 and a build with SIMPLE_HTTP_IO_URING defined
+    // (GYP_DEFINES=io_uring=1), otherwise the server warns and uses libuv.
+    // Call this before listen().
+    void set_io_engine(IoEngine engine);
+
+    // The responses to pipelined requests that are ready are written together
+    // in one write of up to max_bytes (default 256 KB), or of one response if
+    // it is larger. Call this before listen().
+    void set_write_batch_limit(size_t max_bytes);
+
+    // Caches the responses to GET requests that were sent with a max age (see
+    // Response::set_max_age) and serves them again, without calling the
+    // handler, until they expire. Responses are keyed by the URL, the values
+    // of key_headers and the encoding negotiated with the client (see
+    // enable_compression), and evicted when the cache exceeds max_bytes,
+    // counting both the plain and the compressed copy of a response.
+    // Hits are routed and admitted like the other requests (see
+    // set_admission_limits and limit_in_flight).
+    // Call this before listen().
+    void enable_cache(size_t max_bytes, vector<string> key_headers = vector<string>());
+
+    // Compresses the bodies of 200 responses with gzip or deflate, as accepted
+    // by the client, at the zlib level (1 fastest to 9 best). Bodies smaller
+    // than min_size, or whose content type is not text, JSON, XML or the like,
+    // are sent as they are. Bodies of at least offload_size bytes are
+    // compressed on the libuv thread pool so that the loop is not blocked
+    // (0 never). Cached responses keep their compressed variant.
+    // Call this before listen().
+    void enable_compression(size_t min_size = 1024, int level = 6, size_t offload_size = 64 * 1024);
+
+    // Removes the cached responses whose URL starts with url_prefix
+    // (all of them by default). Can be called from any thread.
+    void invalidate_cache(const string &url_prefix = "");
+
+    // Server statistics, shared by all the workers.
     Varz* varz();
 
    private:
     unique_ptr<ServerImpl> impl;
   };
 
-  // Global logging to standard error.
+  // Global logging to standard error. Messages are formatted by the caller
+  // into a bounded queue and written by a background thread, so a slow
+  // standard error never blocks the event loops. Messages that do not fit in
+  // the queue are dropped and counted. Severe messages wait until written.
   struct Log {
+    enum Level { SEVERE, WARN, INFO };
+
+    // Messages above this level are skipped before formatting, default INFO.
     static int max_level;
+
     static void severe(const char *fmt, ... );
     static void warn(const char *fmt, ... );
     static void info(const char *fmt, ... );
+
+    // Waits until all the messages logged so far are written.
+    static void flush();
+
+    // Number of messages dropped because the queue was full.
+    static unsigned long long dropped();
+
+    // A log site writing at most one message per interval, with the number of
+    // messages suppressed since, e.g.
+    // "static Log::RateLimit slow(1000); slow.warn("slow: %d ms", ms);".
+    class RateLimit {
+     public:
+      explicit RateLimit(int interval_ms);
+      void warn(const char *fmt, ... );
+
+     private:
+      const int interval_ms;
+      std::atomic<long long> next_ms;
+      std::atomic<unsigned> suppressed;
+    };
   };
 
 
   class ClientImpl;
 
+  // Options of a request, see Client::request().
+  struct RequestOptions {
+    RequestOptions(): deadline_ms(0), max_retries(0), hedge_percentile(0) {}
+
+    int deadline_ms;        // The request fails if not answered in time, 0 for no deadline.
+    int max_retries;        // GETs answered with a 5xx status are sent again up to this many times.
+    int hedge_percentile;   // Only for ClientPool::request(), 0 for no hedging.
+  };
+
+  enum class RequestError { NONE, DEADLINE_EXCEEDED, SERVER_ERROR, CONNECTION_LOST };
+
+  typedef std::function<void(RequestError error, const string &body)> ResultCallback;
+
   class Client {
    public:
 
+    // The client runs on the loop of the server worker that creates it,
+    // or on uv_default_loop() when created outside of a server worker.
     Client(const char *addr, int port = 80);
     ~Client();
 
+    // Sends a GET, or a POST of the body if it is not empty (a server only
+    // passes POSTs to post() handlers, see Server::get()). When the
+    // connection is lost before the response, a GET is sent again after
+    // reconnecting, but a POST that was already written is not, since the
+    // server may have run it: its callback gets an empty body.
     void request(const char *url, const string &body,
       std::function<void(const string&)> response_callback);
 
+    // Calls result_callback exactly once: with DEADLINE_EXCEEDED when there is
+    // no response within the deadline, or with SERVER_ERROR and the body of a
+    // 5xx response after the retries, or with CONNECTION_LOST for a POST
+    // whose connection was lost (see above). A late response is dropped. When the
+    // request was already sent, the connection is reconnected at once since
+    // the responses behind the late one would wait for it: the other requests
+    // sent on it are sent again, or failed if they are POSTs.
+    // A hedge_percentile is ignored with a warning, hedging needs a ClientPool.
+    void request(const char *url, const string &body, const RequestOptions &options,
+      ResultCallback result_callback);
+
+    // Sends up to depth requests on the connection before their responses
+    // arrive (HTTP pipelining, default 1). Responses are matched to the
+    // requests in order.
+    void set_pipeline_depth(int depth);
+
     void close();
 
    private:
     unique_ptr<ClientImpl> impl;
   };
 
+  class ClientPoolImpl;
+
+  // Keep-alive connections to several replicas of a backend. Each request
+  // goes to the connected connection with the fewest requests waiting for
+  // their response. A backend whose connections fail is ejected until they
+  // reconnect (retried with an exponential backoff up to 8 seconds), and the
+  // requests not yet written on them are moved to the other connections
+  // (the written ones are handled as by Client::request()).
+  class ClientPool {
+   public:
+    // Backends are "host:port". Runs on the loop of the creating thread, see Client.
+    ClientPool(const vector<string> &backends, int connections_per_backend = 2);
+    ~ClientPool();
+
+    void request(const char *url, const string &body,
+      std::function<void(const string&)> response_callback);
+
+    // See Client::request(). Retries go to another connection when possible.
+    // With a hedge_percentile, a GET not answered after that percentile of
+    // the recent response latencies is sent again on a connection to another
+    // backend, and the first response wins.
+    void request(const char *url, const string &body, const RequestOptions &options,
+      ResultCallback result_callback);
+
+    // See Client::set_pipeline_depth().
+    void set_pipeline_depth(int depth);
+
+    void close();
+
+    // Per-backend statistics: "client_responses:<backend>",
+    // "client_errors:<backend>" (failed or lost connections) and the
+    // "client_latency:<backend>" histogram, from request() to the response;
+    // "client_retries", "client_hedges" and "client_deadline_exceeded".
+    Varz* varz();
+
+   private:
+    unique_ptr<ClientPoolImpl> impl;
+  };
+
 }
 
 #endif
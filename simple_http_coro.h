@@ -0,0 +1,158 @@
+#ifndef SIMPLE_HTTP_CORO_
+#define SIMPLE_HTTP_CORO_
+
+// Coroutine handlers and awaitable client requests, for applications built
+// with C++20 (the library itself stays C++11). A handler returning Task is
+// registered like any other handler, e.g.
+//
+//   static Task merge_handler(Request &req, Response res) {
+//     auto a = request(backend_a(), "/a");     // Both are sent now.
+//     auto b = request(backend_b(), "/b");
+//     res.body() << co_await a << co_await b;
+//     res.send();
+//   }
+//   app().get("/merge", merge_handler);
+//
+// The handler runs until its first co_await within the call of the server,
+// so the Request is only valid until then: copy what is needed before. Take
+// the Response by value, it is kept in the coroutine frame. The requests are
+// made on the loop of the handler and resume it there, so the clients must
+// be created on that loop (one per worker, see Client).
+
+#if !defined(__cpp_impl_coroutine)
+#error "simple_http_coro.h requires C++20 coroutines, e.g. -std=c++20"
+#endif
+
+#include <stdlib.h>
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "simple_http.h"
+
+namespace simple_http {
+
+  // Recycles the coroutine frames of the calling thread by size class,
+  // instead of allocating one per request.
+  class FramePool {
+   public:
+    static constexpr size_t GRANULE = 256;
+    static constexpr size_t NUM_CLASSES = 16;     // Frames up to 4 KB are pooled.
+    static constexpr size_t MAX_FREE = 1024;      // Per class and thread.
+
+    static void* allocate(size_t size) {
+      size_t c = (size - 1) / GRANULE;
+      if (c >= NUM_CLASSES) return ::operator new(size);
+      auto &free = free_lists()[c];
+      if (free.empty()) return ::operator new((c + 1) * GRANULE);
+      void *p = free.back();
+      free.pop_back();
+      return p;
+    }
+
+    static void deallocate(void *p, size_t size) {
+      size_t c = (size - 1) / GRANULE;
+      if (c < NUM_CLASSES && free_lists()[c].size() < MAX_FREE) {
+        free_lists()[c].push_back(p);
+      } else {
+        ::operator delete(p);
+      }
+    }
+
+   private:
+    struct FreeLists {
+      std::vector<void*> lists[NUM_CLASSES];
+      ~FreeLists() {
+        for (auto &l : lists) for (void *p : l) ::operator delete(p);
+      }
+      std::vector<void*>& operator[](size_t i) { return lists[i]; }
+    };
+
+    static FreeLists& free_lists() {
+      static thread_local FreeLists lists;
+      return lists;
+    }
+  };
+
+  // The return type of coroutine handlers. The coroutine starts right away
+  // and its frame is released when it finishes; nothing waits for it.
+  class Task {
+   public:
+    struct promise_type {
+      Task get_return_object() { return Task(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() {
+        Log::severe("Unhandled exception in a coroutine handler");
+        abort();
+      }
+
+      static void* operator new(size_t size) { return FramePool::allocate(size); }
+      static void operator delete(void *p, size_t size) { FramePool::deallocate(p, size); }
+    };
+  };
+
+  // The result of a request made with RequestOptions.
+  struct RequestResult {
+    RequestError error;
+    std::string body;
+  };
+
+  // A request in flight, see request(). Awaiting it suspends the coroutine
+  // until the response arrives, unless it already did, and returns the
+  // response body (or the RequestResult with options). Await it once.
+  template <typename T>
+  class Call {
+   public:
+    struct State {
+      bool done = false;
+      T result;
+      std::coroutine_handle<> waiter;
+
+      void complete(T &&r) {
+        result = std::move(r);
+        done = true;
+        if (waiter) std::exchange(waiter, nullptr).resume();
+      }
+    };
+
+    explicit Call(std::shared_ptr<State> state): state(std::move(state)) {}
+
+    bool await_ready() const { return state->done; }
+    void await_suspend(std::coroutine_handle<> h) { state->waiter = h; }
+    T await_resume() { return std::move(state->result); }
+
+   private:
+    std::shared_ptr<State> state;   // Shared with the response callback.
+  };
+
+  // Sends the request with the Client or ClientPool, to be awaited later so
+  // that several requests are in flight at once.
+  template <typename C>
+  Call<std::string> request(C &client, const char *url, const std::string &body = "") {
+    auto state = std::make_shared<Call<std::string>::State>();
+    client.request(url, body, [state](const std::string &res) {
+      state->complete(std::string(res));
+    });
+    return Call<std::string>(state);
+  }
+
+  template <typename C>
+  Call<RequestResult> request(C &client, const char *url, const std::string &body,
+      const RequestOptions &options) {
+    auto state = std::make_shared<Call<RequestResult>::State>();
+    client.request(url, body, options, [state](RequestError error, const std::string &res) {
+      state->complete(RequestResult { error, res });
+    });
+    return Call<RequestResult>(state);
+  }
+
+}
+
+#endif
@@ -0,0 +1,843 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "simple_http.h"
+#include "zlib.h"
+
+#if defined(__cpp_impl_coroutine)
+#include "simple_http_coro.h"
+#endif
+
+using namespace std;
+using namespace simple_http;
+
+// Regression tests of the server. The server runs on a thread of this
+// process and the tests talk raw HTTP to it over blocking sockets, so that
+// they control how the requests are split into writes.
+// Exits with 1 at the first failed check.
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      _exit(1); \
+    } \
+  } while (0)
+
+static const int PORT = 18080;
+static const int MAX_PIPELINED = 32;
+static const size_t READ_BUFFER_LEN = 64 * 1024;    // The server reads up to this at once.
+
+static Server& app() {
+  static Server s;
+  return s;
+}
+
+struct Reply {
+  int status = 0;
+  string head;            // Status line and headers.
+  string body;
+};
+
+static int connect_server() {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {   // Until the server listens.
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    if (!connect(fd, (struct sockaddr*) &addr, sizeof(addr))) return fd;
+    close(fd);
+    usleep(20 * 1000);
+  }
+  CHECK(!"cannot connect to the server");
+  return -1;
+}
+
+static void send_all(int fd, const string &data) {
+  for (size_t sent = 0; sent < data.size(); ) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    CHECK(n > 0);
+    sent += n;
+  }
+}
+
+// Reads one response with a Content-Length or a chunked body (kept encoded),
+// or up to the end of the stream. The response to a HEAD request, or a 304,
+// has no body. The bytes read past the response are kept in in, for the next
+// response.
+static Reply read_reply(int fd, string &in, bool head = false) {
+  size_t header_end = string::npos, content_length = string::npos;
+  bool chunked = false;
+  size_t searched = 0;    // Where to look for the end of a chunked body.
+  char buf[4096];
+  for (;;) {
+    if (header_end == string::npos && (header_end = in.find("\r\n\r\n")) != string::npos) {
+      header_end += 4;
+      for (size_t pos = in.find("\r\n"); pos < header_end; pos = in.find("\r\n", pos + 2)) {
+        if (!strncasecmp(in.c_str() + pos + 2, "Content-Length:", 15)) {
+          content_length = strtoul(in.c_str() + pos + 17, nullptr, 10);
+        }
+        if (!strncasecmp(in.c_str() + pos + 2, "Transfer-Encoding: chunked", 26)) chunked = true;
+      }
+      if (head || !in.compare(0, 12, "HTTP/1.1 304")) content_length = 0;
+    }
+    if (header_end != string::npos && chunked && !head && content_length == string::npos) {
+      size_t last = in.find("\r\n0\r\n\r\n", max(header_end - 2, searched));
+      if (last != string::npos) content_length = last + 7 - header_end;
+      searched = max(in.size(), (size_t) 6) - 6;   // The end may arrive split.
+    }
+    if (header_end != string::npos && content_length != string::npos &&
+        in.size() >= header_end + content_length) break;
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) break;
+    in.append(buf, n);
+  }
+  Reply reply;
+  if (in.compare(0, 9, "HTTP/1.1 ") == 0) reply.status = atoi(in.c_str() + 9);
+  if (header_end == string::npos) {
+    in.clear();
+  } else {
+    reply.head = in.substr(0, header_end);
+    reply.body = in.substr(header_end, content_length);
+    in.erase(0, header_end + reply.body.size());
+  }
+  return reply;
+}
+
+// Sends data, split in two writes with a pause between them if first_write
+// is set, and reads the reply.
+static Reply request(const string &data, size_t first_write = string::npos) {
+  int fd = connect_server();
+  if (first_write < data.size()) {
+    send_all(fd, data.substr(0, first_write));
+    usleep(100 * 1000);
+    send_all(fd, data.substr(first_write));
+  } else {
+    send_all(fd, data);
+  }
+  string pending;
+  Reply reply = read_reply(fd, pending);
+  close(fd);
+  return reply;
+}
+
+static string get(const string &url) {
+  return "GET " + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+}
+
+static string get(const string &url, const string &headers) {
+  return "GET " + url + " HTTP/1.1\r\nHost: localhost\r\n" + headers + "\r\n";
+}
+
+static string head(const string &url) {
+  return "HEAD " + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+}
+
+static string post(const string &url, const string &body) {
+  return "POST " + url + " HTTP/1.1\r\nHost: localhost\r\nContent-Length: " +
+    to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+
+/***** Handlers *****/
+
+// A client of this server, for the handlers: it runs on their loop.
+static Client& loop_client() {
+  static Client *client = nullptr;
+  if (!client) {
+    client = new Client("127.0.0.1", PORT);
+    client->set_pipeline_depth(8);
+  }
+  return *client;
+}
+
+static void upload_handler(Request &req, Response &res) {
+  res.body() << "received " << req.body.size();
+  res.send();
+}
+
+// Uses the string methods of the body, and the str() of the response body.
+static void echo_handler(Request &req, Response &res) {
+  string first = req.body.substr(0, req.body.find(','));
+  res.body() << strlen(req.body_string().c_str()) << " " << first;
+  if (req.body.find("cd") != StringView::npos) res.body().str(res.body().str() + "!");
+  res.send();
+}
+
+static void stream_upload_handler(Request &req, Response &res, BodyStream &body) {
+  auto received = make_shared<size_t>(0);
+  body.on_data = [received](StringView data) { *received += data.size(); };
+  body.on_end = [res, received]() mutable {
+    res.body() << "received " << *received;
+    res.send();
+  };
+}
+
+static void add_handler(Request &req, Response &res) {
+  res.body() << req.param("a")->number + req.param("b")->number;
+  res.send();
+}
+
+static void user_handler(Request &req, Response &res) {
+  res.body() << "user " << req.param("name")->value;
+  res.send();
+}
+
+static void posts_handler(Request &req, Response &res) {
+  res.body() << "posts " << req.param("name")->value;
+  res.send();
+}
+
+static string text_body() {
+  string body;
+  for (int i = 0; i < 100; i++) body += "line " + to_string(i) + " of the text\n";
+  return body;
+}
+
+static void text_handler(Request &req, Response &res) {
+  res.set_content_type("text/plain");
+  res.body() << (req.url == "/text/small" ? "small" : text_body());
+  res.send();
+}
+
+
+static int versioned_bodies = 0;
+
+static void versioned_handler(Request &req, Response &res) {
+  res.set_max_age(0, 1000000000);
+  res.set_etag("v1");
+  if (!res.not_modified()) {
+    versioned_bodies++;
+    res.body() << "versioned";
+  }
+  res.send();
+}
+
+// Pauses the body at each part for the time of a request to the server.
+static void paused_upload_handler(Request &req, Response &res, BodyStream &body) {
+  struct State {
+    size_t received = 0;
+    int pauses = 0;
+    bool paused = false;
+    bool data_while_paused = false;
+  };
+  auto state = make_shared<State>();
+  BodyStream *stream = &body;
+  body.on_data = [state, stream](StringView data) {
+    if (state->paused) state->data_while_paused = true;
+    state->received += data.size();
+    if (state->pauses++ >= 4) return;
+    state->paused = true;
+    stream->pause();
+    loop_client().request("/route/1", "", [state, stream](const string &body) {
+      state->paused = false;
+      stream->resume();
+    });
+  };
+  body.on_end = [res, state]() mutable {
+    res.body() << "received " << state->received << (state->data_while_paused ? " while paused" : "");
+    res.send();
+  };
+}
+
+// Offloaded, it answers after sleeping the milliseconds of the URL.
+static void sleep_handler(Request &req, Response &res) {
+  usleep(req.param("ms")->number * 1000);
+  res.body() << "slept";
+  res.send();
+}
+
+
+static void route_handler(Request &req, Response &res) {
+  res.body() << "route " << req.url;
+  res.send();
+}
+
+static void chunks_handler(Request &req, Response &res) {
+  for (int i = 0; i < 3; i++) res.write_chunk("chunk ", 6);
+  res.end();
+}
+
+static int stream_drains = 0;
+
+// Writes the left chunks of 64 KB, waiting for the client when it is slow.
+static void write_chunks(Response res, shared_ptr<int> left) {
+  static const string chunk(64 * 1024, 'x');
+  while (*left > 0) {
+    --*left;
+    if (!res.write_chunk(chunk)) {
+      stream_drains++;
+      res.on_drain([res, left]() { write_chunks(res, left); });
+      return;
+    }
+  }
+  res.end();
+}
+
+static void large_stream_handler(Request &req, Response &res) {
+  write_chunks(res, make_shared<int>(128));
+}
+
+// Forwards the request to /route/1 with a Client on the loop of the server.
+static void client_handler(Request &req, Response &res) {
+  RequestOptions options;
+  options.hedge_percentile = 90;    // Ignored, a Client does not hedge.
+  loop_client().request("/route/1", "", options, [res](RequestError error, const string &body) mutable {
+    res.body() << (int) error << " " << body;
+    res.send();
+  });
+}
+
+// Sends 20 requests at once with the pipelined client and answers with the
+// responses in the order of their callbacks.
+static void client_pipeline_handler(Request &req, Response &res) {
+  auto bodies = make_shared<vector<string>>();
+  for (int i = 0; i < 20; i++) {
+    string url = "/route/" + to_string(i);
+    loop_client().request(url.c_str(), "", [res, bodies](const string &body) mutable {
+      bodies->push_back(body);
+      if (bodies->size() < 20) return;
+      for (auto &b : *bodies) res.body() << b << ";";
+      res.send();
+    });
+  }
+}
+
+// Fails the first two requests of each id with a 500.
+static void flaky_handler(Request &req, Response &res) {
+  static std::map<long long, int> calls;
+  if (++calls[req.param("id")->number] <= 2) {
+    res.body() << "failed";
+    return res.send(Response::Code::SERVER_ERROR);
+  }
+  res.body() << "ok";
+  res.send();
+}
+
+// Requests a new flaky id with the retries of the URL.
+static void client_retry_handler(Request &req, Response &res) {
+  static int next_id = 0;
+  string url = "/flaky/" + to_string(next_id++);
+  RequestOptions options;
+  options.max_retries = req.param("n")->number;
+  loop_client().request(url.c_str(), "", options, [res](RequestError error, const string &body) mutable {
+    res.body() << (int) error << " " << body;
+    res.send();
+  });
+}
+
+// Gives up on a slow request after 100 ms, then sends another one on the
+// reconnected client.
+static void client_deadline_handler(Request &req, Response &res) {
+  RequestOptions options;
+  options.deadline_ms = 100;
+  auto start = std::chrono::steady_clock::now();
+  loop_client().request("/sleep/300", "", options, [res, start](RequestError error, const string &body) mutable {
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    res.body() << (int) error << (waited.count() < 250 ? " in time" : " late");
+    loop_client().request("/route/2", "", [res](const string &body) mutable {
+      res.body() << ", " << body;
+      res.send();
+    });
+  });
+}
+
+// Sends 10 requests with a pool whose first backend is down, and answers
+// with the responses received and whether the down backend was counted.
+static void client_pool_handler(Request &req, Response &res) {
+  static const string down = "127.0.0.1:1";
+  static ClientPool *pool = new ClientPool({ down, "127.0.0.1:" + to_string(PORT) }, 2);
+  auto received = make_shared<int>(0), answered = make_shared<int>(0);
+  for (int i = 0; i < 10; i++) {
+    pool->request("/route/3", "", [res, received, answered](const string &body) mutable {
+      if (body == "route /route/3") ++*received;
+      if (++*answered < 10) return;
+      res.body() << *received << (pool->varz()->get("client_errors:" + down) ? " down" : " up");
+      res.send();
+    });
+  }
+}
+
+#if defined(__cpp_impl_coroutine)
+// Awaits two requests sent together, then one that outlasts its retries.
+static Task coro_handler(Request &req, Response res) {
+  auto a = request(loop_client(), "/route/4");
+  auto b = request(loop_client(), "/route/5");
+  res.body() << co_await b << ", " << co_await a;
+  RequestOptions options;
+  options.max_retries = 1;
+  RequestResult r = co_await request(loop_client(), "/flaky/1000", "", options);   // Apart from /client_retry.
+  res.body() << ", " << (int) r.error << " " << r.body;
+  res.send();
+}
+#endif
+
+
+static int cached_calls = 0;
+
+static void cached_handler(Request &req, Response &res) {
+  cached_calls++;
+  unsigned k = 1;
+  for (int i = 0; i < 2000; i++) res.body() << "{\"k\":" << (k = k * 1103515245 + 12345) << "},";
+  res.set_max_age(60);
+  res.send();
+}
+
+
+/***** Tests *****/
+
+// A request whose first write exactly fills the read buffer is followed by
+// an empty read, which is not the end of the stream. The body arrives whole
+// buffered, streamed, and streamed with pauses (no data while paused).
+static void test_body_larger_than_read_buffer() {
+  string body(100 * 1024, 'x');
+  for (const char *url : { "/upload", "/stream_upload", "/paused_upload" }) {
+    Reply reply = request(post(url, body), READ_BUFFER_LEN);
+    CHECK(reply.status == 200);
+    CHECK(reply.body == "received " + to_string(body.size()));
+  }
+}
+
+// Requests over the limits are answered without being read, and the
+// connection is closed.
+static void test_request_limits() {
+  Reply reply = request(get("/route/1", "X-Large: " + string(70 * 1024, 'a') + "\r\n"));
+  CHECK(reply.status == 431 && reply.head.find("Connection: close\r\n") != string::npos);
+  // Only the headers are sent, the body would not be buffered anyway.
+  reply = request("POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Length: 100000000\r\n\r\n");
+  CHECK(reply.status == 413 && reply.head.find("Connection: close\r\n") != string::npos);
+}
+
+static void test_body_accessors() {
+  Reply reply = request(post("/echo", "ab,cd"));
+  CHECK(reply.status == 200 && reply.body == "5 ab!");
+  reply = request(post("/echo", "abc"));
+  CHECK(reply.status == 200 && reply.body == "3 abc");
+}
+
+static void test_malformed_request() {
+  Reply reply = request("GET / HTTP/1.1\r\nHost localhost\r\n\r\n");
+  CHECK(reply.status == 400);
+
+  // The valid request before is answered first.
+  int fd = connect_server();
+  send_all(fd, post("/upload", "abc") + "GARBAGE\r\n\r\n");
+  string pending;
+  reply = read_reply(fd, pending);
+  CHECK(reply.status == 200 && reply.body == "received 3");
+  CHECK(read_reply(fd, pending).status == 400);
+  close(fd);
+}
+
+// Captures, exact patterns ('$') and the longest match.
+static void test_router() {
+  struct { const char *url; int status; const char *body; } cases[] = {
+    { "/add/2,3", 200, "5" },
+    { "/add/-2,3?x=1", 200, "1" },
+    { "/add/x,3", 404, nullptr },
+    { "/user/bob", 200, "user bob" },
+    { "/user/bob/posts", 200, "posts bob" },
+    { "/user/bob/posts?page=2", 200, "posts bob" },
+    { "/user/bob/posts/1", 200, "user bob" },   // Not the exact pattern.
+    { "/route/12", 200, "route /route/12" },    // Not the prefix /route/1.
+  };
+  for (auto &t : cases) {
+    Reply reply = request(get(t.url));
+    CHECK(reply.status == t.status);
+    if (t.body) CHECK(reply.body == t.body);
+  }
+}
+
+// Returns the gzip or zlib (deflate) data inflated, or "" on error.
+static string inflate_body(const string &data) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  CHECK(inflateInit2(&zs, 15 + 32) == Z_OK);    // Detects the header.
+  string out(64 * 1024, 0);
+  zs.next_in = (Bytef*) data.data();
+  zs.avail_in = data.size();
+  zs.next_out = (Bytef*) &out[0];
+  zs.avail_out = out.size();
+  int status = inflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  inflateEnd(&zs);
+  return status == Z_STREAM_END ? out : "";
+}
+
+// Large enough bodies are compressed with gzip, or deflate, when the client
+// accepts it (q > 0).
+static void test_compression() {
+  struct { const char *accept; const char *encoding; } cases[] = {
+    { nullptr, nullptr },
+    { "gzip", "gzip" },
+    { "deflate", "deflate" },
+    { "deflate, gzip;q=0.5", "gzip" },
+    { "gzip;q=0, deflate", "deflate" },
+    { "gzip;q=0", nullptr },
+    { "br", nullptr },
+  };
+  for (auto &t : cases) {
+    Reply reply = request(t.accept ? get("/text", "Accept-Encoding: " + string(t.accept) + "\r\n") : get("/text"));
+    CHECK(reply.status == 200 && reply.head.find("Vary: Accept-Encoding\r\n") != string::npos);
+    if (!t.encoding) {
+      CHECK(reply.head.find("Content-Encoding") == string::npos && reply.body == text_body());
+      continue;
+    }
+    CHECK(reply.head.find("Content-Encoding: " + string(t.encoding) + "\r\n") != string::npos);
+    CHECK(reply.body.size() < text_body().size() && inflate_body(reply.body) == text_body());
+  }
+  Reply reply = request(get("/text/small", "Accept-Encoding: gzip\r\n"));
+  CHECK(reply.body == "small" && reply.head.find("Content-Encoding") == string::npos);
+}
+
+// A conditional GET matching the validators gets 304 Not Modified, and the
+// handler does not produce the body.
+static void test_conditional_get() {
+  Reply reply = request(get("/versioned"));
+  CHECK(reply.status == 200 && reply.body == "versioned");
+  CHECK(reply.head.find("ETag: \"v1\"\r\n") != string::npos);
+  CHECK(reply.head.find("Last-Modified: Sun, 09 Sep 2001 01:46:40 GMT\r\n") != string::npos);
+  CHECK(versioned_bodies == 1);
+
+  struct { const char *headers; int status; } cases[] = {
+    { "If-None-Match: \"v1\"\r\n", 304 },
+    { "If-None-Match: \"v0\", W/\"v1\"\r\n", 304 },   // Weak comparison.
+    { "If-None-Match: *\r\n", 304 },
+    { "If-None-Match: \"v2\"\r\n", 200 },
+    { "If-Modified-Since: Sun, 09 Sep 2001 01:46:40 GMT\r\n", 304 },
+    { "If-Modified-Since: Sun, 09 Sep 2001 01:46:39 GMT\r\n", 200 },
+    // If-None-Match takes precedence.
+    { "If-None-Match: \"v2\"\r\nIf-Modified-Since: Sun, 09 Sep 2001 01:46:40 GMT\r\n", 200 },
+  };
+  for (auto &t : cases) {
+    int bodies = versioned_bodies;
+    reply = request(get("/versioned", t.headers));
+    CHECK(reply.status == t.status);
+    CHECK(reply.head.find("ETag: \"v1\"\r\n") != string::npos);
+    CHECK(reply.body == (t.status == 200 ? "versioned" : ""));
+    CHECK(versioned_bodies == bodies + (t.status == 200));
+  }
+}
+
+// Each route has its own latency histogram.
+static const int NUM_ROUTES = 1000;
+
+static void test_many_routes() {
+  for (int i : { 0, NUM_ROUTES / 2, NUM_ROUTES - 1 }) {
+    string url = "/route/" + to_string(i);
+    Reply reply = request(get(url));
+    CHECK(reply.status == 200 && reply.body == "route " + url);
+  }
+  CHECK(request(get("/missing")).status == 404);
+}
+
+// HEAD requests get the headers of the GET handlers without the body, other
+// methods get 405.
+static void test_head() {
+  struct { string url, body, header; } cases[] = {
+    { "/route/1", "route /route/1", "Content-Length: 14\r\n" },
+    { "/chunks", "6\r\nchunk \r\n6\r\nchunk \r\n6\r\nchunk \r\n0\r\n\r\n", "Transfer-Encoding: chunked\r\n" },
+  };
+  for (auto &t : cases) {
+    // The GET pipelined after the HEAD is read right after its headers.
+    int fd = connect_server();
+    send_all(fd, head(t.url) + get(t.url));
+    string pending;
+    Reply reply = read_reply(fd, pending, true);
+    CHECK(reply.status == 200 && reply.head.find(t.header) != string::npos);
+    reply = read_reply(fd, pending);
+    CHECK(reply.status == 200 && reply.head.find(t.header) != string::npos);
+    CHECK(reply.body == t.body);
+    close(fd);
+  }
+  CHECK(request(post("/route/1", "")).status == 405);
+}
+
+// A Client sends requests with options meant for a ClientPool.
+static void test_client_pipeline() {
+  string expected;
+  for (int i = 0; i < 20; i++) expected += "route /route/" + to_string(i) + ";";
+  Reply reply = request(get("/client_pipeline"));
+  CHECK(reply.status == 200 && reply.body == expected);
+}
+
+static void test_client_options() {
+  Reply reply = request(get("/client"));
+  CHECK(reply.status == 200 && reply.body == "0 route /route/1");
+}
+
+static void test_client_retries() {
+  Reply reply = request(get("/client_retry/2"));
+  CHECK(reply.status == 200 && reply.body == "0 ok");
+  reply = request(get("/client_retry/1"));
+  CHECK(reply.status == 200 && reply.body == "2 failed");
+}
+
+static void test_client_deadline() {
+  Reply reply = request(get("/client_deadline"));
+  CHECK(reply.status == 200 && reply.body == "1 in time, route /route/2");
+}
+
+static void test_client_pool() {
+  Reply reply = request(get("/client_pool"));
+  CHECK(reply.status == 200 && reply.body == "10 down");
+}
+
+#if defined(__cpp_impl_coroutine)
+static void test_coroutines() {
+  Reply reply = request(get("/coro"));
+  CHECK(reply.status == 200 && reply.body == "route /route/5, route /route/4, 2 failed");
+}
+#endif
+
+// Pipelined responses are sent in order, those ready together in one write.
+static void test_pipelined() {
+  unsigned long long writes = app().varz()->get("server_write");
+  int fd = connect_server();
+  string requests;
+  for (int i = 0; i < 16; i++) requests += get("/route/" + to_string(i * 7));
+  send_all(fd, requests);
+  string pending;
+  for (int i = 0; i < 16; i++) {
+    Reply reply = read_reply(fd, pending);
+    CHECK(reply.status == 200 && reply.body == "route /route/" + to_string(i * 7));
+  }
+  close(fd);
+  CHECK(app().varz()->get("server_write") - writes < 16);
+}
+
+// An offloaded handler runs on the pool and sends from there, while the loop
+// answers the other connections.
+static void test_offload() {
+  int fd = connect_server();
+  send_all(fd, get("/sleep/500"));
+  usleep(50 * 1000);
+  auto start = std::chrono::steady_clock::now();
+  CHECK(request(get("/route/1")).status == 200);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(300));
+  string pending;
+  Reply reply = read_reply(fd, pending);
+  CHECK(reply.status == 200 && reply.body == "slept");
+  close(fd);
+}
+
+// Requests over the in-flight and pipeline limits get 503 with Retry-After,
+// except those with a priority prefix.
+static void test_admission() {
+  int fd = connect_server();
+  send_all(fd, get("/limited/300"));
+  usleep(100 * 1000);
+  Reply reply = request(get("/limited/0"));
+  CHECK(reply.status == 503 && reply.head.find("Retry-After: 2\r\n") != string::npos);
+  CHECK(request(get("/limited/1")).status == 200);    // A priority prefix.
+  string pending;
+  CHECK(read_reply(fd, pending).status == 200);
+  close(fd);
+  CHECK(request(get("/limited/0")).status == 200);
+
+  // All the requests are read at once, those over the pipeline limit are shed
+  // and answered in order.
+  fd = connect_server();
+  string requests;
+  for (int i = 0; i < MAX_PIPELINED + 8; i++) requests += get("/sleep/20");
+  send_all(fd, requests);
+  for (int i = 0; i < MAX_PIPELINED + 8; i++) {
+    reply = read_reply(fd, pending);
+    CHECK(reply.status == (i < MAX_PIPELINED ? 200 : 503));
+  }
+  close(fd);
+}
+
+// Returns the payload of a chunked body, or "" if it is malformed.
+static string dechunk(const string &body) {
+  string out;
+  for (size_t pos = 0; pos < body.size(); ) {
+    char *end;
+    size_t size = strtoul(body.c_str() + pos, &end, 16);
+    if (strncmp(end, "\r\n", 2)) return "";
+    pos = end - body.c_str() + 2;
+    if (!size) return body.compare(pos, string::npos, "\r\n") ? "" : out;
+    out.append(body, pos, size);
+    pos += size + 2;
+  }
+  return "";
+}
+
+// A streamed body larger than the socket buffers, read slowly, is produced
+// as the client reads it (on_drain) and arrives whole.
+static void test_large_stream() {
+  int fd = connect_server();
+  send_all(fd, get("/large_stream"));
+  usleep(200 * 1000);
+  string pending;
+  Reply reply = read_reply(fd, pending);
+  close(fd);
+  CHECK(reply.status == 200 && reply.head.find("Transfer-Encoding: chunked\r\n") != string::npos);
+  CHECK(dechunk(reply.body) == string(128 * 64 * 1024, 'x'));
+  CHECK(stream_drains > 0);
+}
+
+static string static_root;
+
+// Files are sent whole or by a single byte range, with validators.
+static void test_static_ranges() {
+  ofstream(static_root + "/digits.txt") << "0123456789";
+  Reply reply = request(get("/static/digits.txt"));
+  CHECK(reply.status == 200 && reply.body == "0123456789");
+  CHECK(reply.head.find("Accept-Ranges: bytes\r\n") != string::npos);
+  size_t etag = reply.head.find("ETag: ");
+  CHECK(etag != string::npos);
+  string etag_value = reply.head.substr(etag + 6, reply.head.find("\r\n", etag) - etag - 6);
+
+  struct { string headers; int status; const char *body, *content_range; } cases[] = {
+    { "Range: bytes=2-4\r\n", 206, "234", "bytes 2-4/10" },
+    { "Range: bytes=7-\r\n", 206, "789", "bytes 7-9/10" },
+    { "Range: bytes=-3\r\n", 206, "789", "bytes 7-9/10" },
+    { "Range: bytes=5-100\r\n", 206, "56789", "bytes 5-9/10" },
+    { "Range: bytes=20-\r\n", 416, "", "bytes */10" },
+    { "Range: bytes=0-1,3-4\r\n", 200, "0123456789", nullptr },   // Several ranges.
+    { "Range: bytes=2-4\r\nIf-Range: " + etag_value + "\r\n", 206, "234", "bytes 2-4/10" },
+    { "Range: bytes=2-4\r\nIf-Range: \"other\"\r\n", 200, "0123456789", nullptr },
+    { "If-None-Match: " + etag_value + "\r\n", 304, "", nullptr },
+  };
+  for (auto &t : cases) {
+    reply = request(get("/static/digits.txt", t.headers));
+    CHECK(reply.status == t.status && reply.body == t.body);
+    if (t.content_range) {
+      CHECK(reply.head.find("Content-Range: " + string(t.content_range) + "\r\n") != string::npos);
+    } else {
+      CHECK(reply.head.find("Content-Range") == string::npos);
+    }
+  }
+  unlink((static_root + "/digits.txt").c_str());
+}
+
+// The URL is decoded once: escapes in file names are not decoded again and
+// do not end the path.
+static void test_static_dir_escapes() {
+  const char *files[][2] = {
+    { "a b.txt", "space" },
+    { "a%20b.txt", "percent" },
+    { "a?b.txt", "question" },
+  };
+  for (auto &f : files) ofstream(static_root + "/" + f[0]) << f[1];
+
+  Reply reply = request(get("/static/a%20b.txt"));
+  CHECK(reply.status == 200 && reply.body == "space");
+  reply = request(get("/static/a%2520b.txt"));
+  CHECK(reply.status == 200 && reply.body == "percent");
+  reply = request(get("/static/a%3Fb.txt"));
+  CHECK(reply.status == 200 && reply.body == "question");
+  reply = request(get("/static/a%3fb.txt?v=2"));
+  CHECK(reply.status == 200 && reply.body == "question");
+  CHECK(request(get("/static/a?b.txt")).status == 404);
+  CHECK(request(get("/static/%2e%2e/static/a%20b.txt")).status == 404);
+  CHECK(request(get("/static/missing.txt")).status == 404);
+
+  for (auto &f : files) unlink((static_root + "/" + f[0]).c_str());
+  rmdir(static_root.c_str());
+}
+
+// Cache hits are routed, and stored per negotiated encoding.
+static void test_cache_encoding() {
+  Reply reply = request(get("/cached"));
+  CHECK(reply.status == 200 && reply.head.find("Content-Encoding") == string::npos);
+  size_t plain_size = reply.body.size();
+  reply = request(get("/cached", "Accept-Encoding: gzip\r\n"));
+  CHECK(reply.status == 200 && reply.head.find("Content-Encoding: gzip") != string::npos);
+  CHECK(cached_calls == 2);
+
+  // The gzip entry holds both bodies, which count against the memory bound.
+  usleep(1100 * 1000);    // Until the statistics are exported.
+  CHECK(app().varz()->get("server_cache_entries") == 2);
+  CHECK(app().varz()->get("server_cache_bytes") >= 2 * plain_size + reply.body.size());
+
+  reply = request(get("/cached", "Accept-Encoding: gzip\r\n"));
+  CHECK(reply.head.find("Content-Encoding: gzip") != string::npos && reply.head.find("Age:") != string::npos);
+  reply = request(get("/cached"));
+  CHECK(reply.head.find("Content-Encoding") == string::npos && reply.head.find("Age:") != string::npos);
+  CHECK(cached_calls == 2);
+  CHECK(request(post("/cached", "")).status == 405);
+}
+
+
+int main(int argc, char *argv[]) {
+  Log::max_level = Log::WARN;
+  app().post("/upload", upload_handler);
+  app().post("/echo", echo_handler);
+  app().get("/add/:a<int>,:b<int>", add_handler);
+  app().get("/user/:name", user_handler);
+  app().get("/user/:name/posts$", posts_handler);
+  app().get("/versioned", versioned_handler);
+  app().get("/text", text_handler);
+  app().stream(Method::POST, "/stream_upload", stream_upload_handler);
+  app().stream(Method::POST, "/paused_upload", paused_upload_handler);
+  char root[] = "/tmp/test_http.XXXXXX";
+  CHECK(mkdtemp(root));
+  static_root = root;
+  app().static_dir("/static/", static_root);
+  app().enable_cache(16 << 20);
+  app().enable_compression(100);
+  app().get("/cached", cached_handler);
+  app().get("/chunks", chunks_handler);
+  app().get("/large_stream", large_stream_handler);
+  app().offload(Method::GET, "/sleep/:ms<int>", sleep_handler);
+  app().offload(Method::GET, "/limited/:ms<int>", sleep_handler);
+  app().limit_in_flight("/limited/", 1);
+  app().add_priority_prefix("/limited/1");
+  app().set_admission_limits(0, MAX_PIPELINED, 2);
+  app().get("/client", client_handler);
+  app().get("/client_pipeline", client_pipeline_handler);
+  app().get("/client_retry/:n<int>", client_retry_handler);
+  app().get("/client_deadline", client_deadline_handler);
+  app().get("/client_pool", client_pool_handler);
+#if defined(__cpp_impl_coroutine)
+  app().get("/coro", coro_handler);
+#endif
+  app().get("/flaky/:id<int>", flaky_handler);
+  for (int i = 0; i < NUM_ROUTES; i++) app().get("/route/" + to_string(i), route_handler);
+  if (argc > 1 && !strcmp(argv[1], "--io_uring")) app().set_io_engine(IoEngine::IO_URING);
+  std::thread([]() { app().listen("127.0.0.1", PORT); }).detach();
+
+  test_body_larger_than_read_buffer();
+  test_request_limits();
+  test_body_accessors();
+  test_malformed_request();
+  test_router();
+  test_conditional_get();
+  test_compression();
+  test_many_routes();
+  test_head();
+  test_large_stream();
+  test_pipelined();
+  test_offload();
+  test_admission();
+  test_client_options();
+  test_client_pipeline();
+  test_client_retries();
+  test_client_deadline();
+  test_client_pool();
+#if defined(__cpp_impl_coroutine)
+  test_coroutines();
+#endif
+  test_static_ranges();
+  test_static_dir_escapes();
+  test_cache_encoding();
+  printf("All tests passed\n");
+  fflush(stdout);
+  _exit(0);   // Without destroying the server under its running thread.
+}
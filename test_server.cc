@@ -16,17 +16,11 @@ static Server& app() {
 
 // Handler for request: "/add/2,3"
 static void add_handler(Request& req, Response& res) {
-  const char* url = req.url.c_str();
-
   // Log to server console.
-  Log::info("url = %s", url);
+  Log::info("url = %s", req.url.c_str());
 
-  long long a, b;
-  if (sscanf(url, "/add/%lld,%lld", &a, &b) != 2) {
-    res.body() << "{\"error\":\"URL Request Error\"}\n";
-    app().varz()->inc("Malformed URL");
-    return res.send(Response::Code::NOT_FOUND);
-  }
+  // Parsed by the route "/add/:a<int>,:b<int>".
+  long long a = req.params[0].number, b = req.params[1].number;
 
   if (a + b > 1000) {
     res.body() << "{\"error\":\"Internal Server Error\"}\n";
@@ -51,17 +45,10 @@ static void add_handler(Request& req, Response& res) {
 static vector<Response> pending;
 
 static void add_async_handler(Request& req, Response& res) {
-  const char* url = req.url.c_str();
-
   // Log to server console.
-  Log::info("async url = %s", url);
+  Log::info("async url = %s", req.url.c_str());
 
-  long long a, b;
-  if (sscanf(url, "/add_async/%lld,%lld", &a, &b) != 2) {
-    res.body() << "{\"error\":\"URL Request Error\"}\n";
-    app().varz()->inc("Malformed URL");
-    return res.send(Response::Code::NOT_FOUND);
-  }
+  long long a = req.param("a")->number, b = req.param("b")->number;
 
   if (a + b > 1000) {
     res.body() << "{\"error\":\"Internal Server Error\"}\n";
@@ -92,11 +79,28 @@ static void add_flush_handler(Request& req, Response& res) {
   pending.clear();
 }
 
+static long long fib(long long n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+
+// Handler for request: "/fib/30", CPU-heavy so it runs on the handler pool.
+static void fib_handler(Request& req, Response& res) {
+  long long n = req.params[0].number;
+  if (n > 40) {
+    res.body() << "{\"error\":\"n is too large\"}\n";
+    return res.send(Response::Code::SERVER_ERROR);
+  }
+  res.body() << "fib(" << n << ") = " << fib(n) << "\n";
+  res.send();
+}
+
 int main(int argc, char* argv[]) {
-  // Beware one is the prefix of another.
-  app().get("/add/", add_handler);
-  app().get("/add_async/", add_async_handler);
+  // Malformed URLs such as "/add/x,y" do not match and get a 404 response.
+  app().get("/add/:a<int>,:b<int>", add_handler);
+  app().get("/add_async/:a<int>,:b<int>", add_async_handler);
   app().get("/add_flush", add_flush_handler);
+  app().offload(Method::GET, "/fib/:n<int>", fib_handler);
+
+  // "./test_server --io_uring" serves with io_uring when it is available.
+  if (argc > 1 && !strcmp(argv[1], "--io_uring")) app().set_io_engine(IoEngine::IO_URING);
 
   // Starts the server.
   app().listen("0.0.0.0", 8000);